@@ -0,0 +1,237 @@
+#!/usr/bin/env bash
+# Benchmark multicopy against cp and tee on synthetic workloads
+# Usage: bench/bench.sh [MULTICOPY]
+# Every run is printed as one JSON object per line and appended to $BENCH_OUT
+# Sizes and modes are set with environment variables, see defaults below
+
+MULTICOPY=$(realpath "${1:-./multicopy}")
+VERSION=$("$MULTICOPY" --version | awk 'NR == 1 {print $2}')
+
+BENCH_DIR=${BENCH_DIR:-/dev/shm} # tmpfs for sources and tmpfs destinations
+BENCH_OUT=${BENCH_OUT:-bench-$VERSION-$(date +%Y%m%d-%H%M%S).jsonl}
+BENCH_WORKLOADS=${BENCH_WORKLOADS:-"huge sparse tiny deep symlinks"}
+BENCH_FS=${BENCH_FS:-"tmpfs ext4 xfs"} # loop mounted filesystems need root, skipped otherwise
+BENCH_LOOP_MB=${BENCH_LOOP_MB:-8192} # size of each loop filesystem image
+BENCH_LOOP_DIR=${BENCH_LOOP_DIR:-${TMPDIR:-/tmp}} # images are on disk, not in memory
+BENCH_ENGINES=${BENCH_ENGINES:-"auto rw threads uring splice mmap offload"} # offload - FICLONE/copy_file_range on the source filesystem
+BENCH_BUFSIZES=${BENCH_BUFSIZES:-"8 64 1024"} # kilobytes
+BENCH_DESTS=${BENCH_DESTS:-"1 8"}
+BENCH_JOBS=${BENCH_JOBS:-"1 8"} # -j for directory workloads
+BENCH_HUGE_MB=${BENCH_HUGE_MB:-256}
+BENCH_SPARSE_MB=${BENCH_SPARSE_MB:-1024} # apparent size, 1% is data
+BENCH_TINY=${BENCH_TINY:-1000000} # files of 1-4 KiB in directories of 1000
+BENCH_DEPTH=${BENCH_DEPTH:-200} # nested directories, 10 files each
+BENCH_SYMLINKS=${BENCH_SYMLINKS:-100000}
+BENCH_STRACE=${BENCH_STRACE:-0} # 1 - count syscalls in an extra run under strace -c
+BENCH_DROP_CACHES=${BENCH_DROP_CACHES:-0} # 1 - drop page cache before each run, needs root
+
+WORK=$(mktemp -d "$BENCH_DIR/multicopy-bench.XXXXXX") || exit 1
+MOUNTS=()
+IMAGES=()
+cleanup() {
+	for mnt in "${MOUNTS[@]}"; do
+		umount "$mnt" 2>/dev/null
+	done
+	rm -rf "$WORK" "${IMAGES[@]}"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+log() {
+	echo "$@" >&2
+}
+
+# Workloads
+
+make_huge() {
+	head -c "${BENCH_HUGE_MB}M" /dev/urandom > "$1"
+}
+
+make_sparse() { # 1 MiB of data every 100 MiB
+	truncate -s "${BENCH_SPARSE_MB}M" "$1"
+	for ((mb = 0; mb < BENCH_SPARSE_MB; mb += 100)); do
+		head -c 1M /dev/urandom | dd of="$1" bs=1M seek="$mb" conv=notrunc status=none
+	done
+}
+
+make_tiny() {
+	mkdir -p "$1"
+	head -c 4096 /dev/urandom > "$WORK/block"
+	for ((i = 0; i < BENCH_TINY; i++)); do
+		if ((i % 1000 == 0)); then
+			dir="$1/d$((i / 1000))"
+			mkdir "$dir"
+		fi
+		head -c $((1024 + i % 3072)) "$WORK/block" > "$dir/f$i"
+	done
+}
+
+make_deep() {
+	local dir=$1
+	mkdir -p "$dir"
+	for ((level = 0; level < BENCH_DEPTH; level++)); do
+		for ((i = 0; i < 10; i++)); do
+			head -c 8192 /dev/urandom > "$dir/f$i"
+		done
+		dir="$dir/l$level"
+		mkdir "$dir"
+	done
+}
+
+make_symlinks() { # links to files, directories and dangling targets
+	mkdir -p "$1/files" "$1/links"
+	for ((i = 0; i < 100; i++)); do
+		head -c 4096 /dev/urandom > "$1/files/f$i"
+	done
+	for ((i = 0; i < BENCH_SYMLINKS; i++)); do
+		case $((i % 3)) in
+			0) ln -s "../files/f$((i % 100))" "$1/links/l$i" ;;
+			1) ln -s ../files "$1/links/l$i" ;;
+			2) ln -s "missing$i" "$1/links/l$i" ;;
+		esac
+	done
+}
+
+# Destination filesystems
+
+declare -A FS_ROOT # directory to put destinations in, per filesystem
+
+setup_fs() { # tmpfs directory or a loop mounted image, skipped if unavailable
+	local fs=$1
+	if [ "$fs" = tmpfs ]; then
+		mkdir -p "$WORK/dest" && FS_ROOT[$fs]="$WORK/dest"
+		return
+	fi
+	if [ "$(id -u)" != 0 ] || ! command -v "mkfs.$fs" > /dev/null; then
+		log "skipping $fs, needs root and mkfs.$fs"
+		return
+	fi
+	local img="$BENCH_LOOP_DIR/${WORK##*/}-$fs.img" # unique per run like $WORK
+	local mnt="$WORK/mnt-$fs"
+	mkdir -p "$mnt"
+	IMAGES+=("$img")
+	truncate -s "${BENCH_LOOP_MB}M" "$img"
+	if ! "mkfs.$fs" -q "$img" > /dev/null 2>&1 || ! mount -o loop "$img" "$mnt"; then
+		log "skipping $fs, cannot create or mount $img"
+		return
+	fi
+	MOUNTS+=("$mnt")
+	FS_ROOT[$fs]=$mnt
+}
+
+# Measurement
+
+seconds() { # bash times format 1m2.345s to seconds
+	awk -v t="$1" 'BEGIN {split(t, p, /[ms]/); print p[1] * 60 + p[2]}'
+}
+
+measure() { # run command, sets WALL, USER, SYS, RSS (KiB, null without GNU time)
+	local start end
+	[ "$BENCH_DROP_CACHES" = 1 ] && sync && echo 3 > /proc/sys/vm/drop_caches
+	if [ -x /usr/bin/time ]; then
+		start=$(date +%s.%N)
+		/usr/bin/time -f "%U %S %M" -o "$WORK/time" "$@" > /dev/null 2> "$WORK/stderr"
+		STATUS=$?
+		end=$(date +%s.%N)
+		read -r USER SYS RSS < <(tail -1 "$WORK/time")
+	else
+		local times
+		start=$(date +%s.%N)
+		times=$( ("$@" > /dev/null 2> "$WORK/stderr"; echo "status $?"; times) )
+		end=$(date +%s.%N)
+		STATUS=$(echo "$times" | awk '/^status/ {print $2}')
+		local children
+		children=$(echo "$times" | tail -1)
+		USER=$(seconds "${children% *}")
+		SYS=$(seconds "${children#* }")
+		RSS=null
+	fi
+	WALL=$(awk -v s="$start" -v e="$end" 'BEGIN {printf "%.6f", e - s}')
+}
+
+syscalls() { # total syscall count of command, null without strace
+	if [ "$BENCH_STRACE" != 1 ] || ! command -v strace > /dev/null; then
+		echo null
+		return
+	fi
+	strace -c -f -o "$WORK/strace" "$@" > /dev/null 2>&1
+	awk '$NF == "total" {print $(NF - 2); found = 1} END {if (!found) print "null"}' "$WORK/strace"
+}
+
+report() { # tool engine bufsize direct jobs, uses WORKLOAD FS DEST_NUM BYTES FILES and measure results
+	local mbps fps
+	mbps=$(awk -v b="$BYTES" -v t="$WALL" 'BEGIN {printf "%.2f", (t > 0 ? b / t / 1048576 : 0)}')
+	fps=$(awk -v f="$FILES" -v t="$WALL" 'BEGIN {printf "%.1f", (t > 0 ? f / t : 0)}')
+	local line
+	line=$(printf '{"version": "%s", "workload": "%s", "fs": "%s", "tool": "%s", "engine": "%s", "bufsize_kb": %s, "direct": %s, "jobs": %s, "dests": %s, "status": %s, "bytes": %s, "files": %s, "seconds": %s, "mb_per_s": %s, "files_per_s": %s, "user_s": %s, "sys_s": %s, "max_rss_kb": %s, "syscalls": %s}' \
+		"$VERSION" "$WORKLOAD" "$FS" "$1" "$2" "$3" "$4" "$5" "$DEST_NUM" "$STATUS" "$BYTES" "$FILES" \
+		"$WALL" "$mbps" "$fps" "$USER" "$SYS" "$RSS" "$6")
+	echo "$line"
+	echo "$line" >> "$BENCH_OUT"
+	if [ "$STATUS" != 0 ]; then
+		log "failed: $1 $2 on $WORKLOAD: $(head -3 "$WORK/stderr")"
+	fi
+}
+
+# Runs
+
+run_multicopy() { # engine bufsize direct jobs
+	local opts=(-f --engine "$1" -b "$2" --no-reflink) # sources and tmpfs destinations share a filesystem
+	[ "$1" = offload ] && opts=(-f -b "$2")
+	[ "$3" = true ] && opts+=(--direct)
+	[ "$4" -gt 1 ] && opts+=(-j "$4")
+	rm -rf "${DESTS[@]}"
+	measure "$MULTICOPY" "${opts[@]}" "$SOURCE" "${DESTS[@]}"
+	local calls
+	calls=$(rm -rf "${DESTS[@]}"; syscalls "$MULTICOPY" "${opts[@]}" "$SOURCE" "${DESTS[@]}")
+	report multicopy "$1" "$2" "$3" "$4" "$calls"
+}
+
+run_baselines() {
+	rm -rf "${DESTS[@]}"
+	measure sh -c 'src=$1; shift; for dest; do cp -a "$src" "$dest" || exit 1; done' cp "$SOURCE" "${DESTS[@]}"
+	report cp none null false 1 "$(rm -rf "${DESTS[@]}"; syscalls sh -c 'src=$1; shift; for dest; do cp -a "$src" "$dest" || exit 1; done' cp "$SOURCE" "${DESTS[@]}")"
+	if [ -f "$SOURCE" ]; then
+		rm -rf "${DESTS[@]}"
+		measure sh -c 'src=$1; shift; tee "$@" < "$src"' tee "$SOURCE" "${DESTS[@]}"
+		report tee none null false 1 "$(rm -rf "${DESTS[@]}"; syscalls sh -c 'src=$1; shift; tee "$@" < "$src"' tee "$SOURCE" "${DESTS[@]}")"
+	fi
+}
+
+log "multicopy $VERSION, results in $BENCH_OUT"
+for FS in $BENCH_FS; do
+	setup_fs "$FS"
+done
+for WORKLOAD in $BENCH_WORKLOADS; do
+	SOURCE="$WORK/src-$WORKLOAD"
+	log "generating $WORKLOAD"
+	"make_$WORKLOAD" "$SOURCE" || exit 1
+	BYTES=$(du -sb --apparent-size "$SOURCE" | cut -f1)
+	FILES=$(find "$SOURCE" -type f | wc -l)
+	jobs_list=1
+	[ -d "$SOURCE" ] && jobs_list=$BENCH_JOBS
+
+	for FS in $BENCH_FS; do
+		root=${FS_ROOT[$FS]}
+		[ -z "$root" ] && continue
+		for DEST_NUM in $BENCH_DESTS; do
+			DESTS=()
+			for ((i = 0; i < DEST_NUM; i++)); do
+				DESTS+=("$root/d$i")
+			done
+			log "$WORKLOAD on $FS to $DEST_NUM destinations"
+			run_baselines
+			for engine in $BENCH_ENGINES; do
+				[ "$engine" = offload ] && [ "$FS" != tmpfs ] && continue # loop filesystems are not the source filesystem
+				for bufsize in $BENCH_BUFSIZES; do
+					for jobs in $jobs_list; do
+						run_multicopy "$engine" "$bufsize" false "$jobs"
+						[ "$FS" != tmpfs ] && run_multicopy "$engine" "$bufsize" true "$jobs" # tmpfs has no O_DIRECT
+					done
+				done
+			done
+			rm -rf "${DESTS[@]}"
+		done
+	done
+	rm -rf "$SOURCE"
+done
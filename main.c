@@ -3,6 +3,7 @@
 
 #define _XOPEN_SOURCE 500
 #define _POSIX_C_SOURCE 200112L
+#define _GNU_SOURCE // syscall(), MAP_POPULATE, Linux specific I/O calls
 
 #include <stdio.h>
 #include <stdbool.h>
@@ -12,50 +13,469 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <ftw.h>
 #include <limits.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <stdint.h>
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING
+#endif
 
-struct Stats {
-	int copied_files;
-	int total_files;
-	int files_read;
-	int files_created;
-	int dirs_read;
-	int dirs_created;
-	int symlinks_read;
-	int symlinks_created;
-	int errors;
-	size_t bytes_read;
-	size_t bytes_written;
-	size_t total_size;
+#define RING_CHUNKS 16 // chunks in flight between reader and writers in threaded engine
+#define ROTATIONAL_BATCH (4L * 1024 * 1024) // bytes written to one destination on a rotational disk before the next one's turn
+#define DIRECT_ALIGN 4096 // minimal buffer and chunk alignment for O_DIRECT
+#define URING_DEPTH 8 // chunks in flight in io_uring engine
+#define MMAP_WINDOW (64L * 1024 * 1024) // source bytes mapped at once in mmap engine
+#define RESUME_CHECK (64 * 1024) // tail bytes compared before --update resumes a destination
+#define OFFLOAD_CHUNK (1L << 30) // bytes per copy_file_range() call
+#define LATENCY_BUCKETS 32 // latency histogram buckets, bucket i counts latencies under 2^i microseconds
+#define PROGRESS_INTERVAL_MS 500 // progress line redraw period
+#define SPLICE_PIPE_SIZE (1024 * 1024) // requested pipe capacity in splice engine, chunk size
+#define SPLIT_RANGE (64L * 1024 * 1024) // bytes per range of --split, files under two ranges are not split
+#define IOPRIO_CLASS_SHIFT 13 // ioprio_set() value is class << 13 | level, as in linux/ioprio.h
+#define IOPRIO_WHO_PROCESS 1
+#define SYNC_WINDOW (8L * 1024 * 1024) // --sync=stream writeback unit, at most two windows per destination are dirty or in flight
+
+enum Op { // Timed system calls, for --stats latency histograms
+	OP_OPEN,
+	OP_READ,
+	OP_WRITE,
+	OP_CLOSE,
+	OP_MKDIR,
+	OP_SYNC,
+	OP_NUM
+};
+
+struct Latency { // Latency histogram of one kind of system call
+	atomic_ulong count;
+	atomic_ulong total_ns;
+	atomic_ulong buckets[LATENCY_BUCKETS];
+};
+
+struct Stats { // Counters are atomic, updated from worker threads with -j
+	_Atomic int copied_files;
+	_Atomic int total_files;
+	_Atomic int files_read;
+	_Atomic int files_created;
+	_Atomic int dirs_read;
+	_Atomic int dirs_created;
+	_Atomic int symlinks_read;
+	_Atomic int symlinks_created;
+	_Atomic int hardlinks_created;
+	_Atomic int files_up_to_date; // destination files skipped by --update
+	_Atomic int files_resumed; // destination files continued from their length by --update
+	_Atomic int errors;
+	_Atomic size_t bytes_read;
+	_Atomic size_t bytes_written;
+	_Atomic size_t bytes_offloaded;
+	_Atomic size_t bytes_holes; // skipped in sparse files
+	_Atomic size_t bytes_compared; // destination bytes read by --delta
+	_Atomic size_t bytes_delta; // differing bytes rewritten by --delta
+	_Atomic size_t bytes_verified; // destination bytes read back by --verify
+	_Atomic int files_verified;
+	_Atomic size_t total_size;
 	char * str_total_size;
+	_Atomic size_t *dest_written; // bytes per destination including offloaded ones, for progress throughput
+	_Atomic size_t *dest_offloaded; // part of dest_written offloaded to the kernel or filesystem
+	_Atomic unsigned engines_used; // bit 1 << enum Engine of every engine that copied data
+	atomic_ulong *dest_write_ns; // time blocked writing per destination, only with --stats
+	struct Latency latency[OP_NUM]; // only with --stats
+	uint64_t start_ns;
 } STATS; //Global struct
 
+struct Progress { // Drawn by reporter thread, copying threads only update atomic counters
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	bool running;
+	int line_len; // length of last drawn line
+	_Atomic off_t file_size; // file shown by -p, the most recently started one with -j
+	_Atomic off_t file_done;
+} PROGRESS; // Global struct
+
+struct Bucket { // Paces writes to rate, idle time is not saved up so a limit holds without bursts
+	pthread_mutex_t lock;
+	double rate; // bytes per second, 0 - unlimited
+	uint64_t next_ns; // when the next write may start
+};
+
+struct Limits { // --bwlimit and --ionice
+	struct Bucket total; // all destinations together
+	struct Bucket *dests; // per destination, NULL if no destination has its own limit
+	int *dest_ioprio; // per destination, NULL if no destination has its own priority
+	int process_ioprio; // restored after writing a destination with its own priority
+} LIMITS = {{PTHREAD_MUTEX_INITIALIZER, 0, 0}, NULL, NULL, 0}; // Global struct
+
 struct Options {
 	char *name;
 	bool force;
 	bool progress;
 	bool global_progress;
 	bool stats;
+	enum StatsFormat {STATS_TEXT, STATS_JSON} stats_format;
 	bool verbose;
 	bool allocate;
 	bool fatal_errors;
+	bool reflink;
+	bool update;
+	bool delta;
+	bool verify;
+	FILE *checksums; // manifest of source checksums, NULL if not requested
+	const char *checksum_root; // prefix of manifest paths, name of directory SOURCE copied by a batch
+	bool direct;
+	enum Sparse {
+		SPARSE_AUTO, // look for holes if file has fewer blocks than its size
+		SPARSE_ALWAYS,
+		SPARSE_NEVER,
+	} sparse;
+	enum Sync {
+		SYNC_NONE, // page cache is written back by the kernel whenever it decides
+		SYNC_END, // syncfs() once per destination filesystem after copying
+		SYNC_FILE, // fsync() every file before closing it, then as SYNC_END
+		SYNC_STREAM, // write-behind with sync_file_range() while copying, then as SYNC_END
+	} sync;
+	enum Order {
+		ORDER_NONE, // files are copied as directories are read
+		ORDER_INODE, // tree is scanned first, files are copied by inode number
+		ORDER_EXTENT, // tree is scanned first, files are copied by disk offset of their first extent
+	} order;
 	int bufsize_kb;
+	size_t bufsize; // bufsize_kb in bytes
+	int jobs; // parallel directory copy workers, 1 - serial walk
+	int split; // threads copying ranges of a large file, 0 - files are copied sequentially
+	enum Engine {
+		ENGINE_AUTO, // splice if source and destinations support it, rw otherwise
+		ENGINE_RW, // read() once, write() to each destination in turn
+		ENGINE_THREADS, // one reader and one writer thread per destination
+		ENGINE_URING, // linked io_uring read and writes, several chunks in flight
+		ENGINE_SPLICE, // splice source into a pipe, tee to a pipe per destination, splice out
+		ENGINE_MMAP, // map source window by window, write from the mapping
+	} engine;
 	int dest_num;
-	char *dest[];
+	char **dest;
+	dev_t *dest_dev; // filesystem of each destination, for reflink/copy_file_range offload
+	int *dest_group; // device group of each destination, destinations on one disk share a group
+	bool *group_rotational; // per device group, writes to a rotational disk are serialized
+	int group_num;
 } OPTS; // Global struct
 
+struct Verifier { // Reads one destination back for --verify
+	pthread_t thread;
+	struct DestFile *dest;
+	uint32_t crc;
+	int error;
+};
+
+static uint32_t CRC32C_TABLE[256]; // software fallback, filled by crc32c_init()
+static bool CRC32C_SSE42 = false;
+
+struct DestFile { // Destination of a single file copy
+	int fd;
+	off_t start; // offset copying starts from, -1 if destination is up to date
+	const char *path; // full path, or destination root when rel is set
+	const char *rel; // path relative to destination root, NULL if path is full
+	int index; // in OPTS.dest
+	bool failed;
+	off_t flushed; // --sync=stream: writeback started for windows below this offset
+	size_t dirty; // --sync=stream: bytes written since the write position was last checked
+};
+
+struct Chunk { // Chunk of source data shared by all writers
+	char *buf;
+	ssize_t len;
+	int refs; // writers that have not written this chunk yet
+};
+
+struct Ring { // Bounded ring of chunks for threaded engine
+	pthread_mutex_t lock;
+	pthread_cond_t filled; // signaled by reader when a chunk is filled or source ended
+	pthread_cond_t drained; // signaled by writers when a chunk is released
+	struct Chunk *chunks;
+	int chunk_cap; // chunks allocated, grows for rotational batches
+	int chunk_num; // chunks in use, 2 is double buffering
+	unsigned long head; // number of chunks filled by reader
+	bool eof;
+};
+
+struct Writer { // Writer thread of threaded engine
+	pthread_t thread;
+	struct Ring *ring;
+	struct DestFile **dests;
+	int dest_num;
+	int batch; // chunks written to a destination at once, ROTATIONAL_BATCH bytes on rotational disks
+};
+
+struct Ranges { // Large file copied by --split threads, each claims the next range
+	int source_fd;
+	struct DestFile *dests;
+	int dest_num;
+	atomic_bool *failed; // per destination, written by every thread
+	off_t size;
+	off_t start;
+	size_t chunk_size;
+	atomic_long next; // index of next unclaimed range
+	atomic_int read_error; // errno of first failed read, stops every thread
+};
+
+#ifdef HAVE_IO_URING
+struct Uring { // io_uring instance with registered buffers and files
+	int fd;
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_len;
+	size_t cq_len;
+	size_t sqes_len;
+	unsigned *sq_tail;
+	unsigned sq_mask;
+	unsigned *sq_array;
+	unsigned sq_queued; // SQEs prepared but not yet published
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	char *bufs[URING_DEPTH];
+	size_t chunk_size;
+};
+#endif
+
+struct Engines { // Resources copy engines set up in a thread on first use and reuse between files
+	char *rw_buf;
+	char *delta_source;
+	char *delta_dest;
+	size_t delta_size;
+	struct Ring ring; // threaded engine
+	size_t ring_size; // size of chunk buffers, 0 - ring not set up
+	int *pipes; // splice engine, a pipe per destination
+	size_t pipe_chunk;
+	bool splice_unsupported; // splice was rejected once, stay on rw engine
+#ifdef HAVE_IO_URING
+	struct Uring uring;
+	int uring_state; // 0 - not set up, 1 - ready, -1 - unavailable
+#endif
+};
+_Thread_local struct Engines ENGINES; // Thread local struct, released by free_engines() before a worker exits
+
+enum TaskType {
+	TASK_DIR, // create directory in destinations, queue its entries
+	TASK_FILE, // copy regular file
+};
+
+struct Task { // Unit of work of parallel directory copy
+	enum TaskType type;
+	char *path;
+	struct stat stat;
+};
+
+struct Deque { // Per worker task deque, owner pops newest, thieves steal oldest
+	pthread_mutex_t lock;
+	struct Task **tasks;
+	size_t head; // oldest task
+	size_t tail; // one past newest task
+	size_t cap;
+};
+
+struct Pool { // Work-stealing pool of parallel directory copy
+	int workers;
+	struct Deque *deques;
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond; // signaled on push, on abort and when the last task is done
+	atomic_long pending; // tasks queued or running
+	size_t queued; // tasks in deques, protected by idle_lock
+	int idle; // sleeping workers, protected by idle_lock
+	atomic_bool abort; // fatal error, stop copying
+	size_t root_len; // length of source path, start of relative paths
+};
+
+struct Worker { // Worker thread of parallel directory copy
+	pthread_t thread;
+	int id;
+	struct Pool *pool;
+};
+
+struct HardLink { // Source inode with several links, copied once
+	dev_t dev;
+	ino_t ino;
+	char *rel; // relative path of the copied link
+	bool copied; // false while first link is being copied
+};
+
+struct LinkMap { // Open addressing hash table of hard links by (dev, ino)
+	pthread_mutex_t lock;
+	pthread_cond_t copied; // broadcast when a first link is copied
+	struct HardLink **slots;
+	size_t cap;
+	size_t num;
+} LINKS = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0}; // Global struct
+
+struct Entry { // Entry of a scanned tree, only stat fields copying needs
+	size_t path; // offset of path relative to source root in FileList.paths
+	mode_t mode;
+	nlink_t nlink;
+	off_t size;
+	blkcnt_t blocks;
+	blksize_t blksize;
+	dev_t dev;
+	ino_t ino;
+	struct timespec mtim;
+	uint64_t physical; // --order=extent: disk offset of first extent, 0 if unknown
+};
+
+struct BatchName { // Name a source gets in target directories, sorted to find sources that would share it
+	const char *name;
+	size_t index;
+};
+
+struct Batch { // Sources of one invocation copied into target directories
+	char **sources;
+	struct stat *stats; // st_mode is 0 for sources that are skipped
+	size_t num;
+	char **targets; // target directories, OPTS.dest points to per source roots while a directory is copied
+	int *target_fds; // target directories opened once, files are created in them with openat()
+	atomic_size_t next; // next source for file copying workers
+	atomic_bool abort; // fatal error, stop copying
+};
+
+struct FileList { // Tree scanned once for -P, copying consumes it instead of walking again
+	struct Entry *entries; // parent directories precede their entries
+	size_t num;
+	size_t cap;
+	char *paths; // relative paths, each NUL terminated
+	size_t paths_len;
+	size_t paths_cap;
+	const char *source_path;
+	atomic_size_t next; // next entry for copying workers
+	atomic_bool abort; // fatal error, stop copying
+};
+
 char *human_readable(size_t bytes);
 void print_usage(char *program_name);
 void print_help(char *program_name);
 void print_version();
 void print_stats();
+void print_json_string(const char *str);
+void print_stats_json();
+uint64_t clock_ns();
+uint64_t record_latency(enum Op op, uint64_t start_ns);
+int write_dest(struct DestFile *dest, const char *buf, size_t len);
+int writev_dest(struct DestFile *dest, const struct iovec iov[], int iov_num);
+void write_behind(struct DestFile *dest, size_t len);
+void flush_windows(int fd, off_t base, off_t end, off_t *flushed);
+int sync_file(const struct DestFile *dest);
+int sync_dests();
+int close_timed(int fd);
+double parse_rate(const char *str);
+int parse_ioprio(const char *str);
+int dest_prefix(const char *spec, const char **value);
+int set_ioprio(int ioprio);
+uint64_t bucket_take(struct Bucket *bucket, size_t len);
+bool rate_limited(const struct DestFile *dest);
+void throttle(const struct DestFile *dest, size_t len);
+void switch_ioprio(int ioprio);
+void restore_ioprio();
 
-int copy_file(const char *source_path, const struct stat *source_stat, char *dest[]);
-int count_dir_files(const char *entry_path, const struct stat *entry_stat, int tflag, struct FTW *ftwbuf);
+int copy_file(int source_dirfd, const char *source_name, const char *source_path, const struct stat *source_stat,
+		int dest_dirfds[], char *dest[], const char *rel_path);
+int copy_file_contents(int source_dirfd, const char *source_name, const char *source_path, const struct stat *source_stat,
+		int dest_dirfds[], char *dest[], const char *rel_path);
+int copy_stream(int source_fd, const char *source_path, const struct stat *source_stat, char *dest[]);
+struct HardLink *claim_hardlink(const struct stat *source_stat, const char *rel_path, bool *first);
+void hardlink_copied(struct HardLink *link);
+void free_hardlinks();
+int make_dest_link(const char *target, int dirfd, const char *name, const char *root, const char *rel);
+const char *display_path(const char *root, const char *rel);
+const char *dest_display(const struct DestFile *dest);
+int offload_copy(int source_fd, const struct stat *source_stat, struct DestFile *dest, bool sparse);
+int delta_copy(int source_fd, const char *source_path, struct DestFile *dest, uint32_t *crc);
+void crc32c_init();
+uint32_t crc32c(uint32_t crc, const char *buf, size_t len);
+uint32_t crc32c_zeros(uint32_t crc, off_t len);
+int checksum_fd(int fd, uint32_t *crc, off_t *size);
+void *verify_thread(void *arg);
+int verify_dests(uint32_t crc, struct DestFile dests[], int dest_num);
+off_t update_start(int source_fd, const struct stat *source_stat, struct DestFile *dest);
+bool drop_direct(int fd);
+ssize_t read_chunk(int fd, char *buf, size_t len);
+ssize_t pread_chunk(int fd, char *buf, size_t len, off_t offset);
+int write_full(int fd, const char *buf, size_t len);
+int pwrite_dest(const struct DestFile *dest, const char *buf, size_t len, off_t offset);
+int open_direct(int dirfd, const char *name, int flags, mode_t mode);
+void count_written(const struct DestFile *dest, size_t len);
+void count_read(enum Engine engine, size_t len, off_t file_done);
+void count_offloaded(const struct DestFile *dest, size_t len);
+void print_progress(double rate, double average_rate, const double dest_rates[]);
+void *progress_thread(void *arg);
+void start_progress();
+void stop_progress();
+int copy_data(int source_fd, const char *source_path, const struct stat *source_stat, struct DestFile dests[], int dest_num, off_t length, uint32_t *crc);
+int copy_data_sparse(int source_fd, const char *source_path, const struct stat *source_stat, struct DestFile dests[], int dest_num, off_t start, uint32_t *crc);
+int copy_data_rw(int source_fd, const char *source_path, struct DestFile dests[], int dest_num, off_t length, uint32_t *crc);
+void *writer_thread(void *arg);
+int copy_data_threaded(int source_fd, const char *source_path, struct DestFile dests[], int dest_num,
+		int chunk_num, size_t chunk_size, bool per_device, off_t length, uint32_t *crc);
+void *range_thread(void *arg);
+int copy_data_split(int source_fd, const char *source_path, const struct stat *source_stat, struct DestFile dests[], int dest_num, off_t start);
+int copy_data_mmap(int source_fd, const char *source_path, const struct stat *source_stat, struct DestFile dests[], int dest_num, off_t length, uint32_t *crc);
+int splice_full(int in_fd, int out_fd, size_t len);
+void close_pipes(int *pipes, int pipe_num);
+void free_engines();
+int copy_data_splice(int source_fd, const char *source_path, struct DestFile dests[], int dest_num, off_t length);
+#ifdef HAVE_IO_URING
+int uring_setup(struct Uring *uring, size_t chunk_size);
+void uring_free(struct Uring *uring);
+void uring_release_files(struct Uring *uring, int file_num);
+struct io_uring_sqe *uring_get_sqe(struct Uring *uring);
+int uring_submit_and_wait(struct Uring *uring);
+int copy_data_uring(int source_fd, const char *source_path, const struct stat *source_stat, struct DestFile dests[], int dest_num, off_t length);
+#endif
 const char *relative_path(const char *entry_path, int level);
-int handle_dir_entry(const char *entry_path, const struct stat *entry_stat, int tflag, struct FTW *ftwbuf);
+dev_t path_device(const char *path);
+dev_t disk_device(dev_t dev, bool *rotational);
+int count_devices(const struct DestFile dests[], int dest_num);
+bool share_rotational(const struct DestFile dests[], int dest_num);
+char *dest_path(const char *dest, const char *rel_path);
+int make_dest_dir(int dirfd, const char *name, mode_t mode, const char *root, const char *rel);
+int read_symlink(int dirfd, const char *name, const char *path, char target[PATH_MAX]);
+int make_dest_symlink(const char *target, int dirfd, const char *name, const char *root, const char *rel);
+void raise_fd_limit();
+int copy_dir(const char *source_path, const struct stat *source_stat);
+int walk_dir(int source_dirfd, int dest_dirfds[], char path[PATH_MAX], size_t path_len, size_t root_len);
+void pool_push(struct Pool *pool, int worker, struct Task *task);
+struct Task *pool_pop(struct Pool *pool, int worker);
+void pool_task_done(struct Pool *pool, struct Task *task);
+struct Task *new_task(enum TaskType type, char *path, const struct stat *stat);
+int pool_dir_task(struct Pool *pool, int worker, struct Task *task);
+int pool_file_task(struct Pool *pool, struct Task *task);
+void *pool_worker(void *arg);
+int copy_dir_parallel(const char *source_path, const struct stat *source_stat);
+void list_add(struct FileList *list, const char *rel_path, const struct stat *entry_stat);
+void entry_to_stat(const struct Entry *entry, struct stat *entry_stat);
+uint64_t first_extent(int dirfd, const char *name);
+int compare_entries(const void *a, const void *b);
+int scan_tree(const char *source_path, struct FileList *list);
+int scan_dir(int source_dirfd, struct FileList *list, char path[PATH_MAX], size_t path_len, size_t root_len);
+int copy_list_entry(struct FileList *list, const struct Entry *entry);
+void *list_worker(void *arg);
+int copy_list(const struct stat *source_stat, struct FileList *list);
+char **read_sources(const char *files_from, char delim, char *sources[], size_t *source_num);
+void *batch_worker(void *arg);
+int compare_batch_names(const void *a, const void *b);
+int copy_batch(char *sources[], size_t source_num);
+void free_list(struct FileList *list);
 
 
 int main(int argc, char *argv[]) {
@@ -64,11 +484,31 @@ int main(int argc, char *argv[]) {
 	OPTS.progress = false;
 	OPTS.global_progress = false;
 	OPTS.stats = false;
+	OPTS.stats_format = STATS_TEXT;
 	OPTS.verbose = false;
 	OPTS.allocate = false;
 	OPTS.fatal_errors = false;
+	OPTS.reflink = true;
+	OPTS.update = false;
+	OPTS.delta = false;
+	OPTS.verify = false;
+	OPTS.checksums = NULL;
+	OPTS.checksum_root = NULL;
+	OPTS.direct = false;
+	OPTS.sparse = SPARSE_AUTO;
+	OPTS.sync = SYNC_NONE;
+	OPTS.order = ORDER_NONE;
 	OPTS.bufsize_kb = 8;
+	OPTS.bufsize = 0;
+	OPTS.jobs = 1;
+	OPTS.split = 0;
+	OPTS.engine = ENGINE_AUTO;
 	OPTS.dest_num = 0;
+	OPTS.dest = NULL;
+	OPTS.dest_dev = NULL;
+	OPTS.dest_group = NULL;
+	OPTS.group_rotational = NULL;
+	OPTS.group_num = 0;
 
 	STATS.copied_files = 0;
 	STATS.total_files = 0;
@@ -78,15 +518,43 @@ int main(int argc, char *argv[]) {
 	STATS.dirs_created = 0;
 	STATS.symlinks_read = 0;
 	STATS.symlinks_created = 0;
+	STATS.hardlinks_created = 0;
+	STATS.files_up_to_date = 0;
+	STATS.files_resumed = 0;
 	STATS.errors = 0;
 	STATS.total_size = 0;
 	STATS.bytes_read = 0;
 	STATS.bytes_written = 0;
+	STATS.bytes_offloaded = 0;
+	STATS.bytes_holes = 0;
+	STATS.bytes_compared = 0;
+	STATS.bytes_delta = 0;
+	STATS.bytes_verified = 0;
+	STATS.files_verified = 0;
 	STATS.str_total_size = NULL;
+	STATS.dest_written = NULL;
+	STATS.dest_offloaded = NULL;
+	STATS.dest_write_ns = NULL;
+	STATS.engines_used = 0;
 
 	enum longopt {
 		allocate,
+		files_from,
+		bwlimit,
+		ionice,
+		split,
 		fatal_errors,
+		engine,
+		stats_format,
+		no_reflink,
+		update,
+		delta,
+		verify,
+		checksums,
+		direct,
+		sparse,
+		sync_mode,
+		order,
 		help,
 		version,
 	};
@@ -95,17 +563,47 @@ int main(int argc, char *argv[]) {
 		{"progress", no_argument, 0, 'p'},
 		{"global-progress", no_argument, 0, 'P'},
 		{"stats", no_argument, 0, 's'},
+		{"stats-format", required_argument, 0, stats_format},
 		{"verbose", no_argument, 0, 'v'},
 		{"buffsize", required_argument, 0, 'b'},
+		{"jobs", required_argument, 0, 'j'},
+		{"target-directory", required_argument, 0, 't'},
+		{"files-from", required_argument, 0, files_from},
+		{"null", no_argument, 0, '0'},
+		{"bwlimit", required_argument, 0, bwlimit},
+		{"ionice", required_argument, 0, ionice},
 		{"allocate", no_argument, 0, allocate},
+		{"split", required_argument, 0, split},
 		{"fatal-errors", no_argument, 0, fatal_errors},
+		{"engine", required_argument, 0, engine},
+		{"no-reflink", no_argument, 0, no_reflink},
+		{"update", no_argument, 0, update},
+		{"delta", no_argument, 0, delta},
+		{"verify", no_argument, 0, verify},
+		{"checksums", required_argument, 0, checksums},
+		{"direct", no_argument, 0, direct},
+		{"sparse", required_argument, 0, sparse},
+		{"sync", required_argument, 0, sync_mode},
+		{"order", required_argument, 0, order},
 		{"help", no_argument, 0, help},
 		{"version", no_argument, 0, version},
+		{0, 0, 0, 0},
 	};
+	// Batch mode with -t or --files-from, destinations are target directories
+	char **targets = NULL;
+	int target_num = 0;
+	const char *files_from_path = NULL;
+	char delim = '\n';
+	// Applied once destinations are known, N= refers to them
+	char **bwlimits = NULL;
+	int bwlimit_num = 0;
+	char **ionices = NULL;
+	int ionice_num = 0;
+
 	// Parse command line arguments
 	int opt;
 	int option_index = 0;
-	while ((opt = getopt_long(argc, argv, ":fpPsvb:", long_options, NULL)) != -1) {
+	while ((opt = getopt_long(argc, argv, ":fpPsvb:j:t:0", long_options, NULL)) != -1) {
 		switch(opt) {
 			case 'f':
 				OPTS.force = true;
@@ -130,12 +628,145 @@ int main(int argc, char *argv[]) {
 					exit(EXIT_FAILURE);
 				}
 				break;
+			case 'j':
+				OPTS.jobs = atoi(optarg);
+				if (OPTS.jobs <= 0) {
+					fprintf(stderr, "%s: invalid number of jobs -- '%s'\n", OPTS.name, optarg);
+					fprintf(stdout, "Try '%s --help' for more information'\n", OPTS.name);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 't':
+				targets = realloc(targets, (target_num + 1) * sizeof(char *));
+				targets[target_num++] = optarg;
+				break;
+			case files_from:
+				files_from_path = optarg;
+				break;
+			case '0':
+				delim = '\0';
+				break;
+			case bwlimit:
+				bwlimits = realloc(bwlimits, (bwlimit_num + 1) * sizeof(char *));
+				bwlimits[bwlimit_num++] = optarg;
+				break;
+			case ionice:
+				ionices = realloc(ionices, (ionice_num + 1) * sizeof(char *));
+				ionices[ionice_num++] = optarg;
+				break;
 			case allocate:
 				OPTS.allocate = true;
 				break;
+			case split:
+				OPTS.split = atoi(optarg);
+				if (OPTS.split <= 0) {
+					fprintf(stderr, "%s: invalid number of split threads -- '%s'\n", OPTS.name, optarg);
+					fprintf(stdout, "Try '%s --help' for more information'\n", OPTS.name);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case fatal_errors:
 				OPTS.fatal_errors = true;
 				break;
+			case engine:
+				if (strcmp(optarg, "auto") == 0) {
+					OPTS.engine = ENGINE_AUTO;
+				} else if (strcmp(optarg, "rw") == 0) {
+					OPTS.engine = ENGINE_RW;
+				} else if (strcmp(optarg, "threads") == 0) {
+					OPTS.engine = ENGINE_THREADS;
+				} else if (strcmp(optarg, "mmap") == 0) {
+					OPTS.engine = ENGINE_MMAP;
+				} else if (strcmp(optarg, "splice") == 0) {
+					OPTS.engine = ENGINE_SPLICE;
+				} else if (strcmp(optarg, "uring") == 0) {
+#ifdef HAVE_IO_URING
+					OPTS.engine = ENGINE_URING;
+#else
+					if (OPTS.verbose) fprintf(stdout, "io_uring not supported in this build, using rw engine\n");
+#endif
+				} else {
+					fprintf(stderr, "%s: invalid engine -- '%s'\n", OPTS.name, optarg);
+					fprintf(stdout, "Try '%s --help' for more information'\n", OPTS.name);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case stats_format:
+				if (strcmp(optarg, "text") == 0) {
+					OPTS.stats_format = STATS_TEXT;
+				} else if (strcmp(optarg, "json") == 0) {
+					OPTS.stats_format = STATS_JSON;
+					OPTS.stats = true;
+				} else {
+					fprintf(stderr, "%s: invalid stats format -- '%s'\n", OPTS.name, optarg);
+					fprintf(stdout, "Try '%s --help' for more information'\n", OPTS.name);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case no_reflink:
+				OPTS.reflink = false;
+				break;
+			case update:
+				OPTS.update = true;
+				break;
+			case delta:
+				OPTS.delta = true;
+				break;
+			case verify:
+				OPTS.verify = true;
+				break;
+			case checksums:
+				if (OPTS.checksums != NULL) fclose(OPTS.checksums);
+				OPTS.checksums = fopen(optarg, "w");
+				if (OPTS.checksums == NULL) {
+					fprintf(stderr, "%s: cannot open checksum file '%s': %s\n", OPTS.name, optarg, strerror(errno));
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case direct:
+				OPTS.direct = true;
+				break;
+			case sparse:
+				if (strcmp(optarg, "auto") == 0) {
+					OPTS.sparse = SPARSE_AUTO;
+				} else if (strcmp(optarg, "always") == 0) {
+					OPTS.sparse = SPARSE_ALWAYS;
+				} else if (strcmp(optarg, "never") == 0) {
+					OPTS.sparse = SPARSE_NEVER;
+				} else {
+					fprintf(stderr, "%s: invalid sparse mode -- '%s'\n", OPTS.name, optarg);
+					fprintf(stdout, "Try '%s --help' for more information'\n", OPTS.name);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case sync_mode:
+				if (strcmp(optarg, "none") == 0) {
+					OPTS.sync = SYNC_NONE;
+				} else if (strcmp(optarg, "end") == 0) {
+					OPTS.sync = SYNC_END;
+				} else if (strcmp(optarg, "file") == 0) {
+					OPTS.sync = SYNC_FILE;
+				} else if (strcmp(optarg, "stream") == 0) {
+					OPTS.sync = SYNC_STREAM;
+				} else {
+					fprintf(stderr, "%s: invalid sync mode -- '%s'\n", OPTS.name, optarg);
+					fprintf(stdout, "Try '%s --help' for more information'\n", OPTS.name);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case order:
+				if (strcmp(optarg, "none") == 0) {
+					OPTS.order = ORDER_NONE;
+				} else if (strcmp(optarg, "inode") == 0) {
+					OPTS.order = ORDER_INODE;
+				} else if (strcmp(optarg, "extent") == 0) {
+					OPTS.order = ORDER_EXTENT;
+				} else {
+					fprintf(stderr, "%s: invalid order -- '%s'\n", OPTS.name, optarg);
+					fprintf(stdout, "Try '%s --help' for more information'\n", OPTS.name);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case help:
 				print_help(OPTS.name);
 				exit(EXIT_SUCCESS);
@@ -156,24 +787,49 @@ int main(int argc, char *argv[]) {
 				break;
 		}
 	}
+	OPTS.bufsize = (size_t)OPTS.bufsize_kb * 1024;
+
 	// Count extra arguments
-	OPTS.dest_num = argc - optind - 1;
-	if (OPTS.dest_num < 1) {
+	bool batch = target_num > 0 || files_from_path != NULL;
+	char *source_path = NULL;
+	char **sources = NULL; // batch mode
+	size_t source_num = 0;
+	size_t argument_sources = 0; // sources after these were read from --files-from
+	if (target_num > 0) { // every argument is a SOURCE
+		OPTS.dest_num = target_num;
+		OPTS.dest = targets;
+		sources = &argv[optind];
+		source_num = argc - optind;
+		argument_sources = source_num;
+	} else if (files_from_path != NULL) { // every argument is a DIRECTORY
+		OPTS.dest_num = argc - optind;
+		OPTS.dest = malloc(OPTS.dest_num * sizeof(char *));
+		memcpy(OPTS.dest, &argv[optind], OPTS.dest_num * sizeof(char *));
+	} else {
+		OPTS.dest_num = argc - optind - 1;
+		if (OPTS.dest_num >= 1) {
+			source_path = argv[optind++]; // optind now on first DESTINATION argument
+			OPTS.dest = malloc(OPTS.dest_num * sizeof(char *));
+			memcpy(OPTS.dest, &argv[optind], OPTS.dest_num * sizeof(char *));
+		}
+	}
+	if (files_from_path != NULL) {
+		sources = read_sources(files_from_path, delim, sources, &source_num); // copies argument sources, allocates memory
+	}
+	if (OPTS.dest_num < 1 || (batch && source_num < 1)) {
 		fprintf(stderr, "%s: not enough arguments\n", OPTS.name);
 		print_usage(OPTS.name);
 		exit(EXIT_FAILURE);
 	}
 
-	size_t source_len = strlen(argv[optind]);
-	char *source_path = argv[optind];
-	if (source_path[source_len - 1] == '/') source_path[source_len - 1] = '\0'; // remove trailing slash
-
-	optind++; // optind now on first DESTINATION argument
+	if (!batch) {
+		size_t source_len = strlen(source_path);
+		if (source_path[source_len - 1] == '/') source_path[source_len - 1] = '\0'; // remove trailing slash
+	}
 	for (int i = 0; i < OPTS.dest_num; i++) {
-		size_t dest_len = strlen(argv[optind + i]);
-		OPTS.dest[i] = argv[optind + i];
+		size_t dest_len = strlen(OPTS.dest[i]);
 		if (OPTS.dest[i][dest_len - 1] == '/') OPTS.dest[i][dest_len - 1] = '\0'; // remove trailing slash
-		if (strcmp(OPTS.dest[i], source_path) == 0) { // DEST is the same as SOURCE
+		if (!batch && strcmp(OPTS.dest[i], source_path) == 0) { // DEST is the same as SOURCE
 			fprintf(stderr, "%s: source and destination cannot be the same: '%s'\n", OPTS.name, OPTS.dest[i]);
 			exit(EXIT_FAILURE);
 		}
@@ -183,11 +839,23 @@ int main(int argc, char *argv[]) {
 	for (int i = 0; i < OPTS.dest_num; i++) {
 		allocated_memory[i] = NULL;
 	}
+	// Target directories are resolved once for all sources of a batch
+	for (int i = 0; batch && i < OPTS.dest_num; i++) {
+		struct stat buff;
+		if (stat(OPTS.dest[i], &buff) == -1 || !S_ISDIR(buff.st_mode)) {
+			fprintf(stderr, "%s: target '%s' is not a directory\n", OPTS.name, OPTS.dest[i]);
+			exit(EXIT_FAILURE);
+		}
+	}
 	// Same name copy if DEST is a directory
-	for (int i = 0; i < OPTS.dest_num; i++) {
+	for (int i = 0; !batch && i < OPTS.dest_num; i++) {
 		struct stat buff;
 		if (stat(OPTS.dest[i], &buff) == 0) {
 			if (S_ISDIR(buff.st_mode)) { // DEST is directory, appending SOURCE name
+				if (strcmp(source_path, "-") == 0) {
+					fprintf(stderr, "%s: cannot copy standard input into directory '%s'\n", OPTS.name, OPTS.dest[i]);
+					exit(EXIT_FAILURE);
+				}
 				const char *source_name = relative_path(source_path, 0);
 				char * dest = OPTS.dest[i];
 				size_t path_len = snprintf(NULL, 0, "%s/%s", dest, source_name);
@@ -201,7 +869,87 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	if (!OPTS.force) {
+	OPTS.dest_dev = malloc(OPTS.dest_num * sizeof(dev_t));
+	STATS.dest_written = calloc(OPTS.dest_num, sizeof(*STATS.dest_written));
+	STATS.dest_offloaded = calloc(OPTS.dest_num, sizeof(*STATS.dest_offloaded));
+	STATS.dest_write_ns = calloc(OPTS.dest_num, sizeof(*STATS.dest_write_ns));
+	OPTS.dest_group = malloc(OPTS.dest_num * sizeof(int));
+	OPTS.group_rotational = malloc(OPTS.dest_num * sizeof(bool));
+	dev_t group_disk[OPTS.dest_num];
+	for (int i = 0; i < OPTS.dest_num; i++) {
+		OPTS.dest_dev[i] = path_device(OPTS.dest[i]);
+		// Grouping destinations by disk, partitions and filesystems of one disk share its queue
+		bool rotational;
+		dev_t disk = disk_device(OPTS.dest_dev[i], &rotational);
+		int group = 0;
+		while (group < OPTS.group_num && group_disk[group] != disk) group++;
+		if (group == OPTS.group_num) {
+			group_disk[group] = disk;
+			OPTS.group_rotational[group] = rotational;
+			OPTS.group_num++;
+		}
+		OPTS.dest_group[i] = group;
+		if (OPTS.verbose) fprintf(stdout, "'%s' is on device %u:%u%s\n", OPTS.dest[i], major(disk), minor(disk), rotational ? " (rotational)" : "");
+	}
+
+	// Bandwidth limits, RATE for all destinations together, N=RATE for destination N
+	for (int i = 0; i < bwlimit_num; i++) {
+		const char *value;
+		int dest = dest_prefix(bwlimits[i], &value);
+		double rate = parse_rate(value);
+		if (rate <= 0 || dest > OPTS.dest_num) {
+			fprintf(stderr, "%s: invalid bandwidth limit -- '%s'\n", OPTS.name, bwlimits[i]);
+			fprintf(stdout, "Try '%s --help' for more information'\n", OPTS.name);
+			exit(EXIT_FAILURE);
+		}
+		if (dest == 0) {
+			LIMITS.total.rate = rate;
+			continue;
+		}
+		if (LIMITS.dests == NULL) {
+			LIMITS.dests = calloc(OPTS.dest_num, sizeof(struct Bucket));
+			for (int j = 0; j < OPTS.dest_num; j++) {
+				pthread_mutex_init(&LIMITS.dests[j].lock, NULL);
+			}
+		}
+		LIMITS.dests[dest - 1].rate = rate;
+	}
+	// I/O priorities, CLASS for the process and its threads, N=CLASS while writing to destination N
+	int process_ioprio = 0; // none, follows CPU nice
+	for (int i = 0; i < ionice_num; i++) {
+		const char *value;
+		int dest = dest_prefix(ionices[i], &value);
+		int ioprio = parse_ioprio(value);
+		if (ioprio == -1 || dest > OPTS.dest_num) {
+			fprintf(stderr, "%s: invalid I/O priority -- '%s'\n", OPTS.name, ionices[i]);
+			fprintf(stdout, "Try '%s --help' for more information'\n", OPTS.name);
+			exit(EXIT_FAILURE);
+		}
+		if (set_ioprio(ioprio) == -1) { // realtime needs CAP_SYS_ADMIN, tried here for destinations too
+			fprintf(stderr, "%s: cannot set I/O priority '%s': %s\n", OPTS.name, ionices[i], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if (dest == 0) {
+			process_ioprio = ioprio;
+			continue;
+		}
+		if (LIMITS.dest_ioprio == NULL) {
+			LIMITS.dest_ioprio = malloc(OPTS.dest_num * sizeof(int));
+			for (int j = 0; j < OPTS.dest_num; j++) {
+				LIMITS.dest_ioprio[j] = -1; // process priority, filled below
+			}
+		}
+		LIMITS.dest_ioprio[dest - 1] = ioprio;
+	}
+	for (int i = 0; LIMITS.dest_ioprio != NULL && i < OPTS.dest_num; i++) {
+		if (LIMITS.dest_ioprio[i] == -1) LIMITS.dest_ioprio[i] = process_ioprio;
+	}
+	if (ionice_num > 0) set_ioprio(process_ioprio); // inherited by every thread started later
+	LIMITS.process_ioprio = process_ioprio;
+	free(bwlimits);
+	free(ionices);
+
+	if (!batch && !OPTS.force && !OPTS.update && !OPTS.delta) {
 		// Check if overwriting
 		int overwriting = 0;
 		for (int i = 0; i < OPTS.dest_num; i++) {
@@ -218,12 +966,31 @@ int main(int argc, char *argv[]) {
 	}
 
 	// Stat SOURCE
+	STATS.start_ns = clock_ns();
 	struct stat statbuff;
-	if (lstat(source_path, &statbuff) == -1) {
+	bool from_stdin = !batch && strcmp(source_path, "-") == 0;
+	bool batch_failed = false; // copied the other SOURCEs, synced and reported before exiting with failure
+	if (batch) { // SOURCEs are checked and copied into target directories
+		batch_failed = copy_batch(sources, source_num) != 0;
+	} else if (from_stdin ? fstat(STDIN_FILENO, &statbuff) == -1 : lstat(source_path, &statbuff) == -1) {
 		fprintf(stderr, "%s: cannot stat '%s': %s\n", OPTS.name, source_path, strerror(errno));
 		exit(EXIT_FAILURE);
-	}
-	if (S_ISREG(statbuff.st_mode)) { // SOURCE is regular file
+	} else if (from_stdin || S_ISFIFO(statbuff.st_mode)) { // SOURCE is a stream, read once until it ends
+		char *dest[OPTS.dest_num]; // Copy variable sized global array to static size local array
+		for (int i = 0; i < OPTS.dest_num; i++) {
+			dest[i] = OPTS.dest[i];
+		}
+		int source_fd = from_stdin ? STDIN_FILENO : open(source_path, O_RDONLY);
+		if (source_fd == -1) {
+			fprintf(stderr, "%s: cannot read '%s': %s\n", OPTS.name, source_path, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		STATS.total_files = 1;
+		STATS.copied_files = 1;
+		start_progress();
+		if (copy_stream(source_fd, from_stdin ? "standard input" : source_path, &statbuff, dest) != 0) exit(EXIT_FAILURE);
+
+	} else if (S_ISREG(statbuff.st_mode)) { // SOURCE is regular file
 		char *dest[OPTS.dest_num]; // Copy variable sized global array to static size local array
 		for (int i = 0; i < OPTS.dest_num; i++) {
 			dest[i] = OPTS.dest[i];
@@ -231,32 +998,42 @@ int main(int argc, char *argv[]) {
 		STATS.total_files = 1;
 		STATS.copied_files = 1;
 		STATS.str_total_size = human_readable(statbuff.st_size); // malloc
-		int copy_result = copy_file(source_path, &statbuff, dest);
+		STATS.total_size = statbuff.st_size;
+		start_progress();
+		int copy_result = copy_file(AT_FDCWD, source_path, source_path, &statbuff, NULL, dest, NULL);
 		if (copy_result != 0) exit(EXIT_FAILURE);
 
 	} else if (S_ISDIR(statbuff.st_mode)) { // SOURCE is directory
-		if (OPTS.global_progress) {
-			// Counting files
-			int nftw_result = nftw(source_path, count_dir_files, 10, FTW_PHYS); // FTW_PHYS (no symlincs)
-			if (nftw_result == -1) {
-				fprintf(stderr, "%s: nftw error on counting files: %s\n", OPTS.name, strerror(errno));
-				exit(EXIT_FAILURE);
-			}
+		if (OPTS.global_progress || OPTS.order != ORDER_NONE) {
+			// Counting or ordering files, the tree is walked once and copied from the list
+			struct FileList list;
+			if (scan_tree(source_path, &list) != 0) exit(EXIT_FAILURE);
 			STATS.str_total_size = human_readable(STATS.total_size); // malloc
-		}
-		//Copying files
-		int nftw_result = nftw(source_path, handle_dir_entry, 10, FTW_PHYS); // FTW_PHYS (no symlincs)
-		if (nftw_result == -1) {
-			fprintf(stderr, "%s: nftw error: %s\n", OPTS.name, strerror(errno));
-			exit(EXIT_FAILURE);
+			start_progress();
+			int copy_result = copy_list(&statbuff, &list);
+			free_list(&list);
+			if (copy_result != 0) exit(EXIT_FAILURE);
+		} else if (OPTS.jobs > 1) {
+			//Copying files
+			start_progress();
+			if (copy_dir_parallel(source_path, &statbuff) != 0) exit(EXIT_FAILURE);
+		} else {
+			start_progress();
+			if (copy_dir(source_path, &statbuff) != 0) exit(EXIT_FAILURE);
 		}
 
 	} else {
-		fprintf(stderr, "%s: '%s' is not a regular file or directory\n", OPTS.name, source_path);
+		fprintf(stderr, "%s: '%s' is not a regular file, directory or pipe\n", OPTS.name, source_path);
 		exit(EXIT_FAILURE);
 	}
 
-	if (OPTS.stats) print_stats();
+	if (OPTS.sync != SYNC_NONE && sync_dests() != 0) exit(EXIT_FAILURE);
+	stop_progress();
+	if (OPTS.stats && OPTS.stats_format == STATS_JSON) {
+		print_stats_json();
+	} else if (OPTS.stats) {
+		print_stats();
+	}
 	if (OPTS.verbose) {
 		fprintf(stdout, "Copied to %i destinations:\n", OPTS.dest_num);
 		for (int i = 0; i < OPTS.dest_num; i++) {
@@ -269,8 +1046,28 @@ int main(int argc, char *argv[]) {
 		free(allocated_memory[i]); 
 	}
 	free(STATS.str_total_size);
+	free(OPTS.dest);
+	if (files_from_path != NULL) {
+		for (size_t i = argument_sources; i < source_num; i++) {
+			free(sources[i]);
+		}
+		free(sources);
+	}
+	free(OPTS.dest_dev);
+	free(OPTS.dest_group);
+	free(OPTS.group_rotational);
+	free(LIMITS.dests);
+	free(LIMITS.dest_ioprio);
+	free(STATS.dest_written);
+	free(STATS.dest_offloaded);
+	free(STATS.dest_write_ns);
+	free_hardlinks();
+	if (OPTS.checksums != NULL && fclose(OPTS.checksums) == EOF) {
+		fprintf(stderr, "%s: error writing checksum file: %s\n", OPTS.name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
 
-	exit(EXIT_SUCCESS);
+	exit(batch_failed ? EXIT_FAILURE : EXIT_SUCCESS);
 }
 
 
@@ -289,6 +1086,8 @@ char *human_readable(size_t bytes) { // allocates memory
 
 void print_usage(char *program_name) {
 	fprintf(stdout, "Usage: %s [OPTION]... SOURCE DESTINATION...\n", program_name);
+	fprintf(stdout, "  or:  %s [OPTION]... -t DIRECTORY... SOURCE...\n", program_name);
+	fprintf(stdout, "  or:  %s [OPTION]... --files-from FILE DIRECTORY...\n", program_name);
 }
 
 void print_help(char *program_name) {
@@ -296,7 +1095,13 @@ void print_help(char *program_name) {
 	fprintf(stdout, "\
 Copy SOURCE to one or more DESTINATION(s) simultaneously\n\
 If SOURCE is a directory - recursively copies a directory (symlinks are copied, not followed)\n\
+If SOURCE is '-' (standard input) or a named pipe, it is read until it ends and streamed to\n\
+every DESTINATION, spliced and tee()d through enlarged pipes unless the rw engine is chosen\n\
 If DESTINATION is a directory, SOURCE is copied into that directory\n\
+Files hard linked within SOURCE are copied once and hard linked in DESTINATION(s)\n\
+With -t or --files-from every SOURCE is copied into every target DIRECTORY in one run,\n\
+regular files first (in parallel with -j), then directories, a SOURCE with the name\n\
+of an earlier one is skipped\n\
 Options:\n\
 -f --force\n\
 \tforce copy even if destination files exist (overwrites files)\n\
@@ -304,16 +1109,93 @@ Options:\n\
 \tdisplay persent copied for each file\n\
 -P --global-progress\n\
 \tdisplay total persent copied of all files in a directory\n\
+\tprogress shows throughput, ETA and throughput of each destination,\n\
+\tredrawn twice a second\n\
 -s --stats\n\
 \tshow stats at the end (files opened/created, bytes read/written)\n\
+--stats-format <format>\n\
+\tformat of stats, default=text\n\
+\t  text - summary lines\n\
+\t  json - engines that ran, every counter, per destination bytes written and\n\
+\t         offloaded and write time, elapsed time, latency histograms of\n\
+\t         open/read/write/close/mkdir/sync, implies -s\n\
 -v --verbose\n\
 \tbe verbose\n\
 -b --buffsize <size>\n\
 \tbuffer size in kilobytes, default=8\n\
+-j --jobs <n>\n\
+\tcopy directories with n parallel workers, default=1\n\
+-t --target-directory <dir>\n\
+\tcopy every SOURCE into dir, may be repeated, all arguments are SOURCEs\n\
+--files-from <file>\n\
+\tread SOURCEs from file, one per line, '-' reads standard input,\n\
+\twithout -t all arguments are target DIRECTORYs\n\
+-0 --null\n\
+\tnames in --files-from are separated by NUL instead of newline\n\
+--bwlimit [N=]<rate>\n\
+\tlimit writes to rate bytes per second, K, M and G suffixes are powers of 1024,\n\
+\tall destinations together, or destination N only (counted from 1),\n\
+\tmay be repeated, writes are paced chunk by chunk\n\
+--ionice [N=]<class>[:<level>]\n\
+\tI/O priority of the process, or while writing destination N (counted from 1),\n\
+\tclass is idle, best-effort or realtime, level 0 (highest) to 7, default=4,\n\
+\tmay be repeated, applies to reads, --direct writes and syncs, page cache\n\
+\twriteback is done by the kernel on its own priority\n\
 --allocate\n\
 \tallocate space for files before copying\n\
+--split <n>\n\
+\tcopy files of 128MiB and more in 64MiB ranges with n threads, every range\n\
+\tis read once and written to all destinations at its offset, space is\n\
+\tallocated up front, smaller files are copied sequentially\n\
 --fatal-errors\n\
 \ttreat every error as fatal and immediately exit\n\
+--update\n\
+\tskip destination files with the size and modification time of source,\n\
+\tresume interrupted copies (shorter, modified after source) from their\n\
+\tlength, implies overwriting\n\
+--delta\n\
+\tcompare existing destination files block by block and rewrite\n\
+\tonly differing blocks, implies overwriting\n\
+--verify\n\
+\tread every destination back, bypassing cache, and compare its CRC32C\n\
+\twith the one computed while copying\n\
+--checksums <file>\n\
+\twrite CRC32C of every source file to file, one 'crc  path' line each,\n\
+\tpaths as in destinations, relative to target directories with -t\n\
+--no-reflink\n\
+\tdon't clone or copy_file_range() to destinations on the source filesystem\n\
+--direct\n\
+\tbypass page cache with O_DIRECT, double-buffered unless engine is threads\n\
+--sparse <when>\n\
+\tskip holes of sparse files and recreate them in destinations, default=auto\n\
+\t  auto - if file has fewer allocated blocks than its size\n\
+\t  always - look for holes in every file\n\
+\t  never - copy holes as zeros\n\
+--sync <mode>\n\
+\tmake destinations durable before exiting, default=none\n\
+\t  none - leave writeback to the kernel\n\
+\t  end - sync each destination filesystem once after copying\n\
+\t  file - fsync every file as it is finished, then as end\n\
+\t  stream - write back 8MiB windows behind the write position and drop them\n\
+\t           from page cache, dirty memory stays bounded, then as end\n\
+--order <key>\n\
+\torder of file copies from a directory SOURCE, default=none\n\
+\t  none - as directories are read\n\
+\t  inode - by inode number\n\
+\t  extent - by disk offset of the first extent (FIEMAP), by inode number\n\
+\t           where unavailable\n\
+\tinode and extent scan the tree first and create its directories and symlinks,\n\
+\tthen copy files, which cuts seeking on rotational and fragmented sources\n\
+--engine <name>\n\
+\tcopy engine, default=auto\n\
+\t  auto - threads if destinations are on several disks or share a rotational\n\
+\t         one, otherwise splice if source and destinations support it, rw otherwise\n\
+\t  rw - read once, write to each destination in turn\n\
+\t  threads - writer thread per destination, one per rotational disk writing\n\
+\t            4MiB batches to its destinations in turn\n\
+\t  uring - batched io_uring read and writes, falls back to rw if unavailable\n\
+\t  splice - zero-copy splice/tee through pipes, falls back to rw if unsupported\n\
+\t  mmap - write to destinations straight from the mapped source\n\
 --help\n\
 \tdisplay this help and exit\n\
 --version\n\
@@ -332,19 +1214,217 @@ There is NO WARRANTY, to the extent permitted by law.\n"
 void print_stats() {
 	fprintf(stdout, "Opened %i dirs, %i files, %i symlinks\n",
 			STATS.dirs_read, STATS.files_read, STATS.symlinks_read);
-	fprintf(stdout, "Created %i dirs, %i files, %i symlinks\n",
-			STATS.dirs_created, STATS.files_created, STATS.symlinks_created);
+	fprintf(stdout, "Created %i dirs, %i files, %i symlinks, %i hard links\n",
+			STATS.dirs_created, STATS.files_created, STATS.symlinks_created, STATS.hardlinks_created);
+	if (OPTS.update) {
+		fprintf(stdout, "Skipped %i files up to date, resumed %i files\n", STATS.files_up_to_date, STATS.files_resumed);
+	}
+	if (OPTS.verify) {
+		char *verified = human_readable(STATS.bytes_verified);
+		fprintf(stdout, "Verified %i files, %s read back\n", STATS.files_verified, verified);
+		free(verified);
+	}
+	if (OPTS.delta) {
+		char *compared = human_readable(STATS.bytes_compared);
+		char *delta = human_readable(STATS.bytes_delta);
+		fprintf(stdout, "%s compared, %s differed\n", compared, delta);
+		free(compared);
+		free(delta);
+	}
 	char *read = human_readable(STATS.bytes_read);
 	char *written = human_readable(STATS.bytes_written);
-	fprintf(stdout, "%s read, %s written, errors: %i\n", read, written, STATS.errors);
+	char *offloaded = human_readable(STATS.bytes_offloaded);
+	char *holes = human_readable(STATS.bytes_holes);
+	fprintf(stdout, "%s read, %s written, %s offloaded, %s skipped in holes, errors: %i\n",
+			read, written, offloaded, holes, STATS.errors);
 	free(read);
 	free(written);
+	free(offloaded);
+	free(holes);
+}
+
+void print_json_string(const char *str) {
+	fputc('"', stdout);
+	for (; *str != '\0'; str++) {
+		unsigned char c = *str;
+		if (c == '"' || c == '\\') {
+			fprintf(stdout, "\\%c", c);
+		} else if (c < 0x20) {
+			fprintf(stdout, "\\u%04x", c);
+		} else {
+			fputc(c, stdout);
+		}
+	}
+	fputc('"', stdout);
+}
+
+void print_stats_json() {
+	// One JSON object on stdout, byte counts are exact, times in seconds
+	static const char *engines[] = {"auto", "rw", "threads", "uring", "splice", "mmap"};
+	static const char *ops[] = {"open", "read", "write", "close", "mkdir", "sync"};
+	double elapsed = (clock_ns() - STATS.start_ns) / 1e9;
+	fprintf(stdout, "{\n");
+	// Engines that copied data, offload first, "none" if every destination was up to date
+	char used[64] = "";
+	if (STATS.bytes_offloaded > 0) strcat(used, "offload");
+	for (int engine = ENGINE_RW; engine <= ENGINE_MMAP; engine++) {
+		if (!(STATS.engines_used & (1u << engine))) continue;
+		if (used[0] != '\0') strcat(used, "+");
+		strcat(used, engines[engine]);
+	}
+	fprintf(stdout, "  \"engine\": \"%s\",\n  \"requested_engine\": \"%s\",\n", used[0] != '\0' ? used : "none", engines[OPTS.engine]);
+	fprintf(stdout, "  \"jobs\": %i,\n  \"split\": %i,\n  \"bufsize\": %zu,\n", OPTS.jobs, OPTS.split, OPTS.bufsize);
+	fprintf(stdout, "  \"elapsed_seconds\": %.6f,\n", elapsed);
+	fprintf(stdout, "  \"files_per_second\": %.1f,\n", elapsed > 0 ? STATS.files_read / elapsed : 0);
+	fprintf(stdout, "  \"bytes_per_second\": %.0f,\n", elapsed > 0 ? STATS.bytes_read / elapsed : 0);
+	fprintf(stdout, "  \"opened\": {\"dirs\": %i, \"files\": %i, \"symlinks\": %i},\n",
+			STATS.dirs_read, STATS.files_read, STATS.symlinks_read);
+	fprintf(stdout, "  \"created\": {\"dirs\": %i, \"files\": %i, \"symlinks\": %i, \"hard_links\": %i},\n",
+			STATS.dirs_created, STATS.files_created, STATS.symlinks_created, STATS.hardlinks_created);
+	fprintf(stdout, "  \"files\": {\"up_to_date\": %i, \"resumed\": %i, \"verified\": %i},\n",
+			STATS.files_up_to_date, STATS.files_resumed, STATS.files_verified);
+	fprintf(stdout, "  \"bytes\": {\"read\": %zu, \"written\": %zu, \"offloaded\": %zu, \"holes\": %zu, "
+			"\"compared\": %zu, \"delta\": %zu, \"verified\": %zu},\n",
+			(size_t)STATS.bytes_read, (size_t)STATS.bytes_written, (size_t)STATS.bytes_offloaded, (size_t)STATS.bytes_holes,
+			(size_t)STATS.bytes_compared, (size_t)STATS.bytes_delta, (size_t)STATS.bytes_verified);
+	fprintf(stdout, "  \"errors\": %i,\n", STATS.errors);
+	fprintf(stdout, "  \"read_seconds\": %.6f,\n  \"write_seconds\": %.6f,\n",
+			STATS.latency[OP_READ].total_ns / 1e9, STATS.latency[OP_WRITE].total_ns / 1e9);
+	fprintf(stdout, "  \"destinations\": [\n");
+	for (int i = 0; i < OPTS.dest_num; i++) {
+		fprintf(stdout, "    {\"path\": ");
+		print_json_string(OPTS.dest[i]);
+		fprintf(stdout, ", \"bytes_written\": %zu, \"bytes_offloaded\": %zu, \"write_seconds\": %.6f}%s\n",
+				(size_t)(STATS.dest_written[i] - STATS.dest_offloaded[i]), (size_t)STATS.dest_offloaded[i],
+				STATS.dest_write_ns[i] / 1e9, i < OPTS.dest_num - 1 ? "," : "");
+	}
+	fprintf(stdout, "  ],\n");
+	// Histogram keys are bucket upper bounds in microseconds, empty buckets are left out
+	fprintf(stdout, "  \"latency\": {\n");
+	for (int op = 0; op < OP_NUM; op++) {
+		fprintf(stdout, "    \"%s\": {\"count\": %lu, \"total_seconds\": %.6f, \"histogram_us\": {",
+				ops[op], (unsigned long)STATS.latency[op].count, STATS.latency[op].total_ns / 1e9);
+		bool first = true;
+		for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+			unsigned long count = STATS.latency[op].buckets[bucket];
+			if (count == 0) continue;
+			fprintf(stdout, "%s\"%lu\": %lu", first ? "" : ", ", 1UL << bucket, count);
+			first = false;
+		}
+		fprintf(stdout, "}}%s\n", op < OP_NUM - 1 ? "," : "");
+	}
+	fprintf(stdout, "  }\n}\n");
+}
+
+int copy_file(int source_dirfd, const char *source_name, const char *source_path, const struct stat *source_stat,
+		int dest_dirfds[], char *dest[], const char *rel_path) {
+	// Inode with several links in the tree is copied once, its other paths become hard links
+	if (source_stat->st_nlink < 2 || rel_path == NULL) {
+		return copy_file_contents(source_dirfd, source_name, source_path, source_stat, dest_dirfds, dest, rel_path);
+	}
+	bool first;
+	struct HardLink *link = claim_hardlink(source_stat, rel_path, &first);
+	if (first) {
+		int copy_result = copy_file_contents(source_dirfd, source_name, source_path, source_stat, dest_dirfds, dest, rel_path);
+		hardlink_copied(link);
+		return copy_result;
+	}
+	int linked = 0;
+	int link_result = 0;
+	for (; linked < OPTS.dest_num && link_result == 0; linked++) {
+		char *target = dest_path(OPTS.dest[linked], link->rel);
+		if (dest_dirfds != NULL) {
+			link_result = make_dest_link(target, dest_dirfds[linked], source_name, OPTS.dest[linked], rel_path);
+		} else {
+			link_result = make_dest_link(target, AT_FDCWD, dest[linked], dest[linked], NULL);
+		}
+		free(target);
+	}
+	if (link_result == 1) { // first link wasn't copied, copy this one instead
+		for (int i = 0; i < linked - 1; i++) {
+			if (dest_dirfds != NULL) {
+				unlinkat(dest_dirfds[i], source_name, 0);
+			} else {
+				unlink(dest[i]);
+			}
+		}
+		return copy_file_contents(source_dirfd, source_name, source_path, source_stat, dest_dirfds, dest, rel_path);
+	}
+	if (link_result == -1 && OPTS.fatal_errors) return -1;
+	return 0;
+}
+
+struct HardLink *claim_hardlink(const struct stat *source_stat, const char *rel_path, bool *first) {
+	// Registers first link of an inode, a later one waits until the first is copied
+	pthread_mutex_lock(&LINKS.lock);
+	if (2 * (LINKS.num + 1) > LINKS.cap) { // keep load under half, grow and rehash
+		size_t cap = LINKS.cap ? LINKS.cap * 2 : 1024;
+		struct HardLink **slots = calloc(cap, sizeof(struct HardLink *));
+		if (slots == NULL) {
+			fprintf(stderr, "%s: cannot allocate hard link map: %s\n", OPTS.name, strerror(ENOMEM));
+			exit(EXIT_FAILURE);
+		}
+		for (size_t i = 0; i < LINKS.cap; i++) {
+			struct HardLink *link = LINKS.slots[i];
+			if (link == NULL) continue;
+			size_t slot = (link->ino ^ link->dev * 0x9e3779b97f4a7c15ULL) & (cap - 1);
+			while (slots[slot] != NULL) slot = (slot + 1) & (cap - 1);
+			slots[slot] = link;
+		}
+		free(LINKS.slots);
+		LINKS.slots = slots;
+		LINKS.cap = cap;
+	}
+	size_t slot = (source_stat->st_ino ^ source_stat->st_dev * 0x9e3779b97f4a7c15ULL) & (LINKS.cap - 1);
+	struct HardLink *link;
+	while ((link = LINKS.slots[slot]) != NULL) {
+		if (link->ino == source_stat->st_ino && link->dev == source_stat->st_dev) break;
+		slot = (slot + 1) & (LINKS.cap - 1);
+	}
+	*first = link == NULL;
+	if (link == NULL) {
+		link = malloc(sizeof(struct HardLink));
+		link->dev = source_stat->st_dev;
+		link->ino = source_stat->st_ino;
+		link->rel = strdup(rel_path);
+		link->copied = false;
+		LINKS.slots[slot] = link;
+		LINKS.num++;
+	} else {
+		while (!link->copied) {
+			pthread_cond_wait(&LINKS.copied, &LINKS.lock);
+		}
+	}
+	pthread_mutex_unlock(&LINKS.lock);
+	return link;
+}
+
+void hardlink_copied(struct HardLink *link) {
+	pthread_mutex_lock(&LINKS.lock);
+	link->copied = true;
+	pthread_cond_broadcast(&LINKS.copied);
+	pthread_mutex_unlock(&LINKS.lock);
 }
 
-int copy_file(const char *source_path, const struct stat *source_stat, char *dest[]) {
+void free_hardlinks() { // map is empty and usable again
+	for (size_t i = 0; i < LINKS.cap; i++) {
+		if (LINKS.slots[i] == NULL) continue;
+		free(LINKS.slots[i]->rel);
+		free(LINKS.slots[i]);
+	}
+	free(LINKS.slots);
+	LINKS.slots = NULL;
+	LINKS.cap = 0;
+	LINKS.num = 0;
+}
+
+int copy_file_contents(int source_dirfd, const char *source_name, const char *source_path, const struct stat *source_stat,
+		int dest_dirfds[], char *dest[], const char *rel_path) {
+	// Files are opened relative to directory fds when walking a tree or copying a batch (dest_dirfds != NULL,
+	// destinations named source_name), or by full paths in dest[]. Paths for messages are only built on errors.
 
 	// Open source file
-	int source_fd = open(source_path, O_RDONLY);
+	int source_fd = open_direct(source_dirfd, source_name, O_RDONLY, 0);
 	if (source_fd < 0) {
 		fprintf(stderr, "%s: cannot read '%s': %s\n", OPTS.name, source_path, strerror(errno));
 		STATS.errors++;
@@ -353,253 +1433,2853 @@ int copy_file(const char *source_path, const struct stat *source_stat, char *des
 	if (OPTS.stats) STATS.files_read++;
 
 	// Get file descriptors and allocate space for new files
-	int dest_fds[OPTS.dest_num];
+	struct DestFile dests[OPTS.dest_num];
+	// --update and --delta read existing contents, --verify reads destinations back
+	int open_flags = OPTS.update || OPTS.delta ? O_CREAT|O_RDWR : O_CREAT|O_TRUNC|(OPTS.verify ? O_RDWR : O_WRONLY);
 	for (int i = 0; i < OPTS.dest_num; i++) {
-		dest_fds[i] = open(dest[i], O_CREAT|O_WRONLY|O_TRUNC, source_stat->st_mode);
-		if (dest_fds[i] < 0) {
-			fprintf(stderr, "%s: cannot create regular file '%s': %s\n", OPTS.name, dest[i], strerror(errno));
+		if (dest_dirfds != NULL) {
+			dests[i].path = OPTS.dest[i];
+			dests[i].rel = (rel_path != NULL) ? rel_path : source_name; // batch files are not in a tree
+			dests[i].fd = open_direct(dest_dirfds[i], source_name, open_flags, source_stat->st_mode);
+		} else {
+			dests[i].path = dest[i];
+			dests[i].rel = NULL;
+			dests[i].fd = open_direct(AT_FDCWD, dest[i], open_flags, source_stat->st_mode);
+		}
+		dests[i].start = 0;
+		dests[i].index = i;
+		dests[i].failed = false;
+		if (dests[i].fd < 0) {
+			fprintf(stderr, "%s: cannot create regular file '%s': %s\n", OPTS.name, dest_display(&dests[i]), strerror(errno));
+			close(source_fd);
+			for (int j = 0; j < i; j++) {
+				close(dests[j].fd);
+			}
 			STATS.errors++;
 			if (OPTS.fatal_errors) {return -1;} else {return 0;}
 		}
-		if (OPTS.stats) STATS.files_created++;
-		if (OPTS.allocate) {
-			if (OPTS.verbose) fprintf(stdout, "Allocating %lu bytes for '%s'\n", source_stat->st_size, dest[i]);
-			int err = posix_fallocate(dest_fds[i], 0, source_stat->st_size);
+		if (OPTS.update) dests[i].start = update_start(source_fd, source_stat, &dests[i]);
+		dests[i].flushed = dests[i].start;
+		dests[i].dirty = 0;
+		if (OPTS.stats && dests[i].start != -1) STATS.files_created++;
+	}
+
+	bool sparse = OPTS.sparse == SPARSE_ALWAYS ||
+			(OPTS.sparse == SPARSE_AUTO && source_stat->st_blocks * 512 < source_stat->st_size);
+
+	// Offload destinations on the source filesystem, stream the rest
+	struct DestFile stream[OPTS.dest_num];
+	int dest_num = 0;
+	struct DestFile *delta[OPTS.dest_num];
+	int delta_num = 0;
+	int copy_result = 0;
+	bool abandoned = false; // allocating or advising failed, file isn't copied but descriptors are closed below
+	for (int i = 0; i < OPTS.dest_num && !abandoned; i++) {
+		if (dests[i].start == -1) continue; // up to date
+		struct stat dest_stat;
+		if (OPTS.delta && dests[i].start == 0 && fstat(dests[i].fd, &dest_stat) == 0 && dest_stat.st_size > 0) {
+			delta[delta_num++] = &dests[i];
+			continue;
+		}
+		if (OPTS.reflink && OPTS.dest_dev[i] == source_stat->st_dev && dests[i].start == 0) {
+			if (offload_copy(source_fd, source_stat, &dests[i], sparse) == 0) continue;
+			if (OPTS.verbose) fprintf(stdout, "Cannot offload '%s', streaming\n", dest_display(&dests[i]));
+		}
+		if (OPTS.allocate && !sparse && dests[i].start == 0 && source_stat->st_size > 0) { // sparse copy allocates data segments only
+			if (OPTS.verbose) fprintf(stdout, "Allocating %lu bytes for '%s'\n", source_stat->st_size, dest_display(&dests[i]));
+			int err = posix_fallocate(dests[i].fd, 0, source_stat->st_size);
 			if ( err != 0) {
-				fprintf(stderr, "%s: cannot allocate space for '%s': %s\n", OPTS.name, dest[i], strerror(err));
+				fprintf(stderr, "%s: cannot allocate space for '%s': %s\n", OPTS.name, dest_display(&dests[i]), strerror(err));
 				STATS.errors++;
-				if (OPTS.fatal_errors) {return -1;} else {return 0;}
+				if (OPTS.fatal_errors) copy_result = -1;
+				abandoned = true;
+				continue;
 			}
 		}
+		// Keep stream sorted by start offset, destinations starting at the same offset are copied together
+		int pos = dest_num++;
+		for (; pos > 0 && stream[pos - 1].start > dests[i].start; pos--) {
+			stream[pos] = stream[pos - 1];
+		}
+		stream[pos] = dests[i];
 	}
 
 	if (OPTS.verbose) fprintf(stdout, "Copying %s to %i destinations...\n", source_path, OPTS.dest_num);
-	if (posix_fadvise(source_fd, 0, 0, POSIX_FADV_SEQUENTIAL) != 0) {
+	if (OPTS.progress) {
+		PROGRESS.file_size = source_stat->st_size;
+		PROGRESS.file_done = 0;
+	}
+	if (!abandoned && posix_fadvise(source_fd, 0, 0, POSIX_FADV_SEQUENTIAL) != 0) {
 		fprintf(stderr, "%s: posix_fadvice on '%s': %s\n", OPTS.name, source_path, strerror(errno));
 		STATS.errors++;
-		if (OPTS.fatal_errors) {return -1;} else {return 0;}
+		if (OPTS.fatal_errors) copy_result = -1;
+		abandoned = true;
 	}
 
-	// Copying files
-	char buf[OPTS.bufsize_kb * 1024];
-	ssize_t total_read = 0;
-	while (1) {
-		ssize_t bytes_read = read(source_fd, &buf[0], sizeof(buf));
-		if (bytes_read == -1) {
+	// Copying files, once per group of destinations with the same start offset
+	// Checksum of source is computed by the group starting at 0 while data is in memory
+	bool checksum = !abandoned && (OPTS.verify || OPTS.checksums != NULL);
+	uint32_t crc = 0;
+	bool crc_done = false;
+	for (int first = 0, group = 0; first < dest_num && copy_result == 0 && !abandoned; first += group) {
+		off_t start = stream[first].start;
+		for (group = 1; first + group < dest_num && stream[first + group].start == start; group++);
+		if (first > 0 || start > 0) { // resuming, or source already read by previous group
+			bool seeked = lseek(source_fd, start, SEEK_SET) == start;
+			for (int i = first; i < first + group; i++) {
+				if (lseek(stream[i].fd, start, SEEK_SET) != start) seeked = false;
+			}
+			if (!seeked) {
+				fprintf(stderr, "%s: cannot seek to %li in '%s': %s\n", OPTS.name, start, source_path, strerror(errno));
+				STATS.errors++;
+				if (OPTS.fatal_errors) copy_result = -1;
+				break;
+			}
+		}
+		bool split = OPTS.split > 0 && !sparse && source_stat->st_size - start >= 2 * SPLIT_RANGE;
+		uint32_t *group_crc = (checksum && start == 0 && !split) ? &crc : NULL; // ranges complete out of order
+		if (split) {
+			copy_result = copy_data_split(source_fd, source_path, source_stat, &stream[first], group, start);
+		} else if (sparse) {
+			copy_result = copy_data_sparse(source_fd, source_path, source_stat, &stream[first], group, start, group_crc);
+		} else {
+			copy_result = copy_data(source_fd, source_path, source_stat, &stream[first], group, -1, group_crc);
+		}
+		if (group_crc != NULL) crc_done = true;
+	}
+
+	// Existing destinations are compared independently, source is read once per destination
+	for (int i = 0; i < delta_num && copy_result == 0 && !abandoned; i++) {
+		copy_result = delta_copy(source_fd, source_path, delta[i], (checksum && !crc_done) ? &crc : NULL);
+		if (checksum) crc_done = true;
+	}
+
+	// Offloaded, resumed and up to date destinations don't pass source through memory
+	if (checksum && copy_result == 0 && !crc_done) {
+		off_t checksum_size;
+		crc = 0;
+		if (checksum_fd(source_fd, &crc, &checksum_size) == -1) {
 			fprintf(stderr, "%s: error reading %s: %s\n", OPTS.name, source_path, strerror(errno));
 			STATS.errors++;
-			if (OPTS.fatal_errors) {return -1;} else {return 0;}
+			checksum = false;
+			if (OPTS.fatal_errors) copy_result = -1;
 		}
-		if (!bytes_read) break; // Source file ended
-		STATS.bytes_read += bytes_read;
+	}
+	if (checksum && copy_result == 0) {
+		if (OPTS.checksums != NULL) { // paths as in destinations, a batch file lands as its name in target directories
+			const char *path = rel_path != NULL ? rel_path : (dest_dirfds != NULL ? source_name : source_path);
+			bool rooted = rel_path != NULL && OPTS.checksum_root != NULL;
+			fprintf(OPTS.checksums, "%08x  %s%s%s\n", crc, rooted ? OPTS.checksum_root : "", rooted ? "/" : "", path);
+		}
+		if (OPTS.verify) copy_result = verify_dests(crc, dests, OPTS.dest_num);
+	}
 
-		for (int i = 0; i < OPTS.dest_num; i++) {
-			ssize_t bytes_written = write(dest_fds[i], &buf[0], bytes_read);
-			if (bytes_written == -1) {
-				fprintf(stderr, "%s: error writing %s: %s\n", OPTS.name, dest[i], strerror(errno));
-				STATS.errors++;
-				if (OPTS.fatal_errors) {return -1;} else {return 0;}
-			}
-			STATS.bytes_written += bytes_written;
-			if (bytes_written != bytes_read) {
-				fprintf(stderr, "%s: error: bytes_written not equal to bytes_read: '%s'\n", OPTS.name, dest[i]);
-				STATS.errors++;
-				if (OPTS.fatal_errors) {return -1;} else {return 0;}
-			}
+	// Modification time of source marks a complete copy for the next --update
+	for (int i = 0; OPTS.update && !abandoned && i < OPTS.dest_num; i++) {
+		struct stat dest_stat;
+		if (dests[i].start == -1 || fstat(dests[i].fd, &dest_stat) == -1 || dest_stat.st_size != source_stat->st_size) continue;
+		struct timespec times[2] = {{0, UTIME_OMIT}, source_stat->st_mtim};
+		if (futimens(dests[i].fd, times) == -1) {
+			fprintf(stderr, "%s: cannot set modification time of '%s': %s\n", OPTS.name, dest_display(&dests[i]), strerror(errno));
+			STATS.errors++;
 		}
-		// Display progress
-		if (OPTS.progress || OPTS.global_progress) {
-			total_read += bytes_read;
-			if (OPTS.global_progress) {
-				char *str_read = human_readable(STATS.bytes_read);
-				double total_percent_copied = ((float)STATS.bytes_read / (float)STATS.total_size) * 100;
-				fprintf(stdout, "%3.0f%% (%s/%s), files (%i/%i)",
-								total_percent_copied, str_read, STATS.str_total_size, STATS.copied_files, STATS.total_files);
-				free(str_read);
-			}
-			if (OPTS.progress) {
-				double persent_copied = ((float)total_read / (float)source_stat->st_size) * 100;
-				fprintf(stdout, " File progress:%3.0f%%     \b\b\b\b\b", persent_copied);
+	}
+
+	// Close file descriptors
+	if (close_timed(source_fd) == -1) {
+		fprintf(stderr, "%s: error closing file descriptor %i '%s': %s\n", OPTS.name, source_fd, source_path, strerror(errno));
+		STATS.errors++;
+	}
+	for (int i = 0; i < OPTS.dest_num; i++) {
+		if (OPTS.sync == SYNC_FILE && dests[i].start != -1 && sync_file(&dests[i]) != 0) copy_result = -1;
+		if (close_timed(dests[i].fd) == -1) {
+			fprintf(stderr, "%s: error closing file descriptor %i '%s': %s\n", OPTS.name, dests[i].fd, dest_display(&dests[i]), strerror(errno));
+			STATS.errors++;
+		}
+	}
+	return copy_result;
+}
+
+int copy_stream(int source_fd, const char *source_path, const struct stat *source_stat, char *dest[]) {
+	// Pipe, socket or terminal is read once until it ends. Its size is unknown and nothing can be read twice,
+	// so every destination is written from the start; --update, --delta, offload and --split don't apply.
+	if (OPTS.stats) STATS.files_read++;
+	struct DestFile dests[OPTS.dest_num];
+	int open_flags = O_CREAT|O_TRUNC|(OPTS.verify ? O_RDWR : O_WRONLY);
+	for (int i = 0; i < OPTS.dest_num; i++) {
+		dests[i].path = dest[i];
+		dests[i].rel = NULL;
+		dests[i].fd = open_direct(AT_FDCWD, dest[i], open_flags, 0666);
+		dests[i].start = 0;
+		dests[i].index = i;
+		dests[i].failed = false;
+		dests[i].flushed = 0;
+		dests[i].dirty = 0;
+		if (dests[i].fd < 0) {
+			fprintf(stderr, "%s: cannot create regular file '%s': %s\n", OPTS.name, dest[i], strerror(errno));
+			for (int j = 0; j < i; j++) {
+				close(dests[j].fd);
 			}
-			fprintf(stdout, "\r");
-			fflush(stdout);
+			STATS.errors++;
+			return -1;
 		}
+		if (OPTS.stats) STATS.files_created++;
 	}
 
-	// Close file descriptors
-	if (close(source_fd) == -1) {
+	// Larger pipe lets the writing side run ahead and moves more per splice
+	if (S_ISFIFO(source_stat->st_mode) && fcntl(source_fd, F_SETPIPE_SZ, SPLICE_PIPE_SIZE) == -1 && OPTS.verbose) {
+		fprintf(stdout, "Cannot resize pipe of %s: %s\n", source_path, strerror(errno));
+	}
+	if (OPTS.verbose) fprintf(stdout, "Copying %s to %i destinations...\n", source_path, OPTS.dest_num);
+	if (OPTS.progress) {
+		PROGRESS.file_size = -1; // unknown
+		PROGRESS.file_done = 0;
+	}
+	bool checksum = OPTS.verify || OPTS.checksums != NULL;
+	uint32_t crc = 0;
+	int copy_result = copy_data(source_fd, source_path, source_stat, dests, OPTS.dest_num, -1, checksum ? &crc : NULL);
+	if (checksum && copy_result == 0) {
+		if (OPTS.checksums != NULL) fprintf(OPTS.checksums, "%08x  %s\n", crc, source_path);
+		if (OPTS.verify) copy_result = verify_dests(crc, dests, OPTS.dest_num);
+	}
+
+	// Close file descriptors, standard input stays open
+	if (source_fd != STDIN_FILENO && close_timed(source_fd) == -1) {
 		fprintf(stderr, "%s: error closing file descriptor %i '%s': %s\n", OPTS.name, source_fd, source_path, strerror(errno));
 		STATS.errors++;
 	}
 	for (int i = 0; i < OPTS.dest_num; i++) {
-		if (close(dest_fds[i]) == -1) {
-			fprintf(stderr, "%s: error closing file descriptor %i '%s': %s\n", OPTS.name, source_fd, dest[i], strerror(errno));
+		if (OPTS.sync == SYNC_FILE && dests[i].start != -1 && sync_file(&dests[i]) != 0) copy_result = -1;
+		if (close_timed(dests[i].fd) == -1) {
+			fprintf(stderr, "%s: error closing file descriptor %i '%s': %s\n", OPTS.name, dests[i].fd, dest_display(&dests[i]), strerror(errno));
 			STATS.errors++;
 		}
 	}
-	if (OPTS.progress || OPTS.global_progress) {
-		fprintf(stdout, "\r");
-		int i;
-		while (i++ < 80) {
-			fputc(' ', stdout);
+	return copy_result;
+}
+
+const char *display_path(const char *root, const char *rel) { // for messages, valid until next call in thread
+	static _Thread_local char path[2 * PATH_MAX];
+	if (rel == NULL) return root;
+	snprintf(path, sizeof(path), "%s/%s", root, rel);
+	return path;
+}
+
+const char *dest_display(const struct DestFile *dest) {
+	return display_path(dest->path, dest->rel);
+}
+
+off_t update_start(int source_fd, const struct stat *source_stat, struct DestFile *dest) {
+	// Where --update continues copying into an existing destination: -1 - it's up to date,
+	// its length - it's an interrupted copy of source, 0 - anything else, destination is truncated
+	struct stat dest_stat;
+	if (fstat(dest->fd, &dest_stat) == -1) return 0;
+	if (dest_stat.st_size == source_stat->st_size &&
+			dest_stat.st_mtim.tv_sec == source_stat->st_mtim.tv_sec &&
+			dest_stat.st_mtim.tv_nsec == source_stat->st_mtim.tv_nsec) {
+		if (OPTS.verbose) fprintf(stdout, "'%s' is up to date\n", dest_display(dest));
+		if (OPTS.stats) STATS.files_up_to_date++;
+		return -1;
+	}
+	// An interrupted copy was last written after source was, a finished copy of an older source carries its
+	// older modification time, which is also older than source now, and may differ anywhere before its end
+	bool interrupted = dest_stat.st_mtim.tv_sec > source_stat->st_mtim.tv_sec ||
+			(dest_stat.st_mtim.tv_sec == source_stat->st_mtim.tv_sec && dest_stat.st_mtim.tv_nsec > source_stat->st_mtim.tv_nsec);
+	if (interrupted && dest_stat.st_size > 0 && dest_stat.st_size < source_stat->st_size) {
+		// Compare tail of destination with source, an interrupted copy ends with the same bytes
+		// Offset and buffers are aligned for --direct, destination read stops short at its end
+		off_t check_offset = dest_stat.st_size < RESUME_CHECK ? 0 : (dest_stat.st_size - RESUME_CHECK) / DIRECT_ALIGN * DIRECT_ALIGN;
+		size_t check = dest_stat.st_size - check_offset;
+		size_t buf_size = (check + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+		char *source_buf = aligned_alloc(DIRECT_ALIGN, buf_size);
+		char *dest_buf = aligned_alloc(DIRECT_ALIGN, buf_size);
+		bool prefix = source_buf != NULL && dest_buf != NULL &&
+				pread(source_fd, source_buf, buf_size, check_offset) >= (ssize_t)check &&
+				pread(dest->fd, dest_buf, buf_size, check_offset) == (ssize_t)check &&
+				memcmp(source_buf, dest_buf, check) == 0;
+		free(source_buf);
+		free(dest_buf);
+		if (prefix) {
+			if (OPTS.verbose) fprintf(stdout, "Resuming '%s' from %li bytes\n", dest_display(dest), dest_stat.st_size);
+			if (OPTS.stats) STATS.files_resumed++;
+			return dest_stat.st_size;
 		}
-		fprintf(stdout, "\r");
+	}
+	if (OPTS.delta) return 0; // rewritten block by block
+	if (ftruncate(dest->fd, 0) == -1) {
+		fprintf(stderr, "%s: cannot truncate '%s': %s\n", OPTS.name, dest_display(dest), strerror(errno));
+		STATS.errors++;
 	}
 	return 0;
 }
 
-int count_dir_files(const char *entry_path, const struct stat *entry_stat, int tflag, struct FTW *ftwbuf) {
-	if (tflag == FTW_F) {
-		STATS.total_files++;
-		STATS.total_size += entry_stat->st_size;
-		char *str_size = human_readable(STATS.total_size);
-		fprintf(stdout, "Counting files: %i, total size: %s\r", STATS.total_files, str_size);
-		fflush(stdout);
-		free(str_size);
+void crc32c_init() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int bit = 0; bit < 8; bit++) {
+			crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1; // reflected Castagnoli polynomial
+		}
+		CRC32C_TABLE[i] = crc;
 	}
-	return 0;
+#ifdef __x86_64__
+	CRC32C_SSE42 = __builtin_cpu_supports("sse4.2");
+#endif
 }
 
-const char *relative_path(const char *entry_path, int level) {
-	size_t path_len = strlen(entry_path);
-	size_t path_pos = path_len;
-	int count = 0;
-	while (path_pos > 0 && count <= level) {
-		path_pos--;
-		if (entry_path[path_pos] == '/') count++;
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const char *buf, size_t len) {
+	uint64_t crc64 = crc;
+	for (; len >= 8; buf += 8, len -= 8) {
+		uint64_t word;
+		memcpy(&word, buf, 8); // buffers are not always 8 byte aligned
+		crc64 = _mm_crc32_u64(crc64, word);
 	}
-	if (entry_path[path_pos] == '/') path_pos++; // remove leading slash
-	return &entry_path[path_pos];
+	crc = crc64;
+	for (; len > 0; buf++, len--) {
+		crc = _mm_crc32_u8(crc, *buf);
+	}
+	return crc;
 }
+#endif
 
-int handle_dir_entry(const char *entry_path, const struct stat *entry_stat, int tflag, struct FTW *ftwbuf) {
-	switch (tflag) {
-		case(FTW_D): // Directory
-		case(FTW_SL): // Symbolic link
-			if (OPTS.stats) {
-				switch(tflag) {
-					case(FTW_D):
-						STATS.dirs_read++;
-						break;
-					case(FTW_SL):
-						STATS.symlinks_read++;
-						break;
-				}
-			}
-			for (int i = 0; i < OPTS.dest_num; i++) {
-				// Creating destination path
-				const char *rel_path = relative_path(entry_path, ftwbuf->level - 1); // (level - 1) to change root directory name
-				size_t path_len = snprintf(NULL, 0, "%s/%s", OPTS.dest[i], rel_path);
-				char path[path_len + 1];
-				if (snprintf(path, path_len + 1, "%s/%s", OPTS.dest[i], rel_path) != path_len) {
-					fprintf(stderr, "%s: snprintf result not equal %i for '%s'\n", OPTS.name, (int)path_len, path);
-					STATS.errors++;
-					if (OPTS.fatal_errors) {return -1;} else {return 0;}
-				}
-				if (path[path_len - 1] == '/') path[path_len - 1] = '\0'; // remove trailing slash
-
-				if (tflag == FTW_D) { // entry_path is a directory
-					// Creating directory
-					if (mkdir(path, entry_stat->st_mode) == -1) {
-						if (errno == EEXIST) { // path exists, checking if it's a directory
-							struct stat sb;
-							if (lstat(path, &sb) == -1) {
-								fprintf(stderr, "%s: cannot stat '%s': %s\n", OPTS.name, path, strerror(errno));
-								STATS.errors++;
-								if (OPTS.fatal_errors) {return -1;} else {return 0;}
-							}
-							if (!S_ISDIR(sb.st_mode)) { // it's not a directory, removing it
-								if (remove(path) == 0) { // file at 'path' removed
-									if (mkdir(path, entry_stat->st_mode) == -1) {
-										fprintf(stderr, "%s: cannot mkdir '%s':%s\n",
-														OPTS.name, path, strerror(errno));
-										STATS.errors++;
-										if (OPTS.fatal_errors) {return -1;} else {return 0;}
-									} else { // directory created
-										if (OPTS.stats) STATS.dirs_created++;
-									}
-								} else { //failed to remove file at 'path'
-									fprintf(stderr, "%s: cannot mkdir, failed overwriting '%s':%s\n",
-													OPTS.name, path, strerror(errno));
-									STATS.errors++;
-									if (OPTS.fatal_errors) {return -1;} else {return 0;}
-								}
-							}
-						} else {
-							fprintf(stderr, "%s: failed creating directory '%s': %s\n", OPTS.name, path, strerror(errno));
-							STATS.errors++;
-							if (OPTS.fatal_errors) {return -1;} else {return 0;}
-						}
-					} else { // directory created
-						if (OPTS.stats) STATS.dirs_created++;
-					}
+uint32_t crc32c(uint32_t crc, const char *buf, size_t len) { // continues crc of preceding data, 0 to start
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_once(&once, crc32c_init);
+	crc = ~crc;
+#ifdef __x86_64__
+	if (CRC32C_SSE42) return ~crc32c_sse42(crc, buf, len);
+#endif
+	for (size_t i = 0; i < len; i++) {
+		crc = CRC32C_TABLE[(crc ^ (unsigned char)buf[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
 
-				} else { // entry_path is a symbolic link
-					ssize_t bufsize;
-					if (entry_stat->st_size == 0) {
-						bufsize = PATH_MAX;
-					} else {
-						bufsize = entry_stat->st_size + 1;
-					}
-					char *target = malloc(bufsize);
-					if (readlink(entry_path, target, bufsize) == -1) {
-						fprintf(stderr, "%s: failed reading symbolic link '%s': %s\n", OPTS.name, entry_path, strerror(errno));
-						free(target);
-						STATS.errors++;
-						if (OPTS.fatal_errors) {return -1;} else {return 0;}
+uint32_t crc32c_zeros(uint32_t crc, off_t len) { // holes of sparse files read as zeros
+	static const char zeros[64 * 1024];
+	while (len > 0) {
+		size_t chunk = len < (off_t)sizeof(zeros) ? (size_t)len : sizeof(zeros);
+		crc = crc32c(crc, zeros, chunk);
+		len -= chunk;
+	}
+	return crc;
+}
+
+int checksum_fd(int fd, uint32_t *crc, off_t *size) { // whole file from offset 0, -1 and errno on error
+	size_t buf_size = (OPTS.bufsize + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN; // aligned for --direct
+	char *buf = aligned_alloc(DIRECT_ALIGN, buf_size);
+	if (buf == NULL) return -1;
+	off_t offset = 0;
+	while (1) {
+		ssize_t bytes_read = pread(fd, buf, buf_size, offset);
+		if (bytes_read == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EINVAL && drop_direct(fd)) continue;
+			free(buf);
+			return -1;
+		}
+		if (bytes_read == 0) break;
+		*crc = crc32c(*crc, buf, bytes_read);
+		offset += bytes_read;
+	}
+	free(buf);
+	*size = offset;
+	return 0;
+}
+
+void *verify_thread(void *arg) {
+	// Flush destination and drop it from page cache, so it is read back from the device
+	struct Verifier *verifier = arg;
+	int fd = verifier->dest->fd;
+	off_t size = 0;
+	verifier->crc = 0;
+	verifier->error = 0;
+	if (fdatasync(fd) == -1) {
+		verifier->error = errno;
+		return NULL;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED); // only a hint, verification still holds if pages stay
+	if (checksum_fd(fd, &verifier->crc, &size) == -1) verifier->error = errno;
+	STATS.bytes_verified += size;
+	return NULL;
+}
+
+int verify_dests(uint32_t crc, struct DestFile dests[], int dest_num) {
+	// Every destination is read back by its own thread, last one by the calling thread
+	struct Verifier verifiers[dest_num];
+	bool started[dest_num];
+	for (int i = 0; i < dest_num; i++) {
+		verifiers[i].dest = &dests[i];
+		started[i] = i < dest_num - 1 && pthread_create(&verifiers[i].thread, NULL, verify_thread, &verifiers[i]) == 0;
+		if (!started[i]) verify_thread(&verifiers[i]);
+	}
+	int failed = 0;
+	for (int i = 0; i < dest_num; i++) {
+		if (started[i]) pthread_join(verifiers[i].thread, NULL);
+		if (verifiers[i].error) {
+			fprintf(stderr, "%s: cannot verify '%s': %s\n", OPTS.name, dest_display(&dests[i]), strerror(verifiers[i].error));
+			failed++;
+		} else if (verifiers[i].crc != crc) {
+			fprintf(stderr, "%s: checksum mismatch in '%s': %08x, expected %08x\n",
+					OPTS.name, dest_display(&dests[i]), verifiers[i].crc, crc);
+			failed++;
+		}
+	}
+	if (OPTS.stats) STATS.files_verified += dest_num - failed;
+	if (failed) {
+		STATS.errors += failed;
+		if (OPTS.fatal_errors) {return -1;} else {return 0;}
+	}
+	return 0;
+}
+
+int delta_copy(int source_fd, const char *source_path, struct DestFile *dest, uint32_t *crc) {
+	// Read source and destination in blocks of bufsize, write only blocks that differ
+	size_t block = (OPTS.bufsize + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN; // aligned for --direct
+	if (ENGINES.delta_size < block) {
+		free(ENGINES.delta_source);
+		free(ENGINES.delta_dest);
+		ENGINES.delta_source = aligned_alloc(DIRECT_ALIGN, block);
+		ENGINES.delta_dest = aligned_alloc(DIRECT_ALIGN, block);
+		if (ENGINES.delta_source == NULL || ENGINES.delta_dest == NULL) {
+			fprintf(stderr, "%s: cannot allocate delta buffers: %s\n", OPTS.name, strerror(errno));
+			free(ENGINES.delta_source);
+			free(ENGINES.delta_dest);
+			ENGINES.delta_source = ENGINES.delta_dest = NULL;
+			ENGINES.delta_size = 0;
+			STATS.errors++;
+			if (OPTS.fatal_errors) {return -1;} else {return 0;}
+		}
+		ENGINES.delta_size = block;
+	}
+
+	if (OPTS.verbose) fprintf(stdout, "Comparing '%s' with '%s'\n", source_path, dest_display(dest));
+	off_t offset = 0;
+	size_t delta_written = 0;
+	while (1) {
+		ssize_t bytes_read = pread(source_fd, ENGINES.delta_source, block, offset);
+		if (bytes_read == -1 && errno == EINVAL && drop_direct(source_fd)) continue;
+		if (bytes_read == -1) {
+			fprintf(stderr, "%s: error reading '%s': %s\n", OPTS.name, source_path, strerror(errno));
+			STATS.errors++;
+			if (OPTS.fatal_errors) {return -1;} else {return 0;}
+		}
+		if (bytes_read == 0) break;
+		count_read(ENGINE_RW, bytes_read, offset + bytes_read); // blocks are read and written like rw engine
+		if (crc != NULL) *crc = crc32c(*crc, ENGINES.delta_source, bytes_read);
+
+		ssize_t bytes_compared = pread(dest->fd, ENGINES.delta_dest, block, offset);
+		if (bytes_compared == -1 && errno == EINVAL && drop_direct(dest->fd)) { // source block is already counted
+			bytes_compared = pread(dest->fd, ENGINES.delta_dest, block, offset);
+		}
+		if (bytes_compared == -1) bytes_compared = 0; // unreadable block is rewritten
+		STATS.bytes_compared += bytes_compared;
+
+		if (bytes_compared < bytes_read || memcmp(ENGINES.delta_source, ENGINES.delta_dest, bytes_read) != 0) {
+			if (lseek(dest->fd, offset, SEEK_SET) != offset || write_dest(dest, ENGINES.delta_source, bytes_read) == -1) {
+				fprintf(stderr, "%s: error writing '%s': %s\n", OPTS.name, dest_display(dest), strerror(errno));
+				STATS.errors++;
+				if (OPTS.fatal_errors) {return -1;} else {return 0;}
+			}
+			delta_written += bytes_read;
+		}
+		offset += bytes_read;
+	}
+	STATS.bytes_delta += delta_written;
+
+	if (ftruncate(dest->fd, offset) == -1) {
+		fprintf(stderr, "%s: cannot truncate '%s': %s\n", OPTS.name, dest_display(dest), strerror(errno));
+		STATS.errors++;
+		if (OPTS.fatal_errors) {return -1;} else {return 0;}
+	}
+	return 0;
+}
+
+int offload_copy(int source_fd, const struct stat *source_stat, struct DestFile *dest, bool sparse) {
+	// Clone extents, works on btrfs, XFS and others with reflink support, holes stay holes
+	if (ioctl(dest->fd, FICLONE, source_fd) == 0) {
+		count_offloaded(dest, source_stat->st_size);
+		return 0;
+	}
+	// Let the kernel copy, may still be server-side or in-kernel without touching user memory
+	// copy_file_range() writes holes as zeros where it can't clone, so a sparse source goes data segment by segment
+	bool limited = rate_limited(dest);
+	size_t chunk = limited ? OPTS.bufsize : OFFLOAD_CHUNK; // paced like streamed writes
+	if (OPTS.sync == SYNC_STREAM && chunk > SYNC_WINDOW) chunk = SYNC_WINDOW; // in-kernel copy dirties page cache too
+	off_t resume = lseek(source_fd, 0, SEEK_CUR); // SEEK_DATA moves it, streaming continues from here
+	off_t copied = 0;
+	loff_t off_in = 0;
+	int result = 0;
+	while (result == 0) {
+		loff_t end = -1; // end of data segment, -1 - until source ends
+		if (sparse) {
+			off_t data = lseek(source_fd, off_in, SEEK_DATA);
+			if (data == -1 && errno == ENXIO) break; // only a hole is left
+			off_t hole = (data == -1) ? -1 : lseek(source_fd, data, SEEK_HOLE);
+			if (hole != -1) { // otherwise holes can't be found, the rest is copied as data
+				off_in = data;
+				end = hole;
+			}
+		}
+		loff_t off_out = off_in;
+		while (end == -1 || off_in < end) {
+			size_t len = chunk;
+			if (end != -1 && (off_t)len > end - off_in) len = end - off_in;
+			if (limited) throttle(dest, len);
+			ssize_t bytes_copied = copy_file_range(source_fd, &off_in, dest->fd, &off_out, len, 0);
+			if (bytes_copied == -1) {
+				if (errno == EINTR) continue;
+				result = -1; // nothing lost, streaming rewrites destination from the start
+				break;
+			}
+			if (!bytes_copied) break; // Source file ended
+			copied += bytes_copied;
+			if (OPTS.sync == SYNC_STREAM) flush_windows(dest->fd, 0, off_out, &dest->flushed);
+		}
+		if (end == -1 || off_in < end) break; // copied until source ended
+	}
+	if (result == 0 && sparse) {
+		if (ftruncate(dest->fd, source_stat->st_size) == -1) { // trailing hole
+			result = -1;
+		} else if (source_stat->st_size > copied) {
+			STATS.bytes_holes += source_stat->st_size - copied;
+		}
+	}
+	restore_ioprio();
+	lseek(source_fd, resume, SEEK_SET);
+	count_offloaded(dest, copied);
+	return result;
+}
+
+int open_direct(int dirfd, const char *name, int flags, mode_t mode) { // with O_DIRECT if --direct and supported
+	uint64_t start_ns = OPTS.stats ? clock_ns() : 0;
+	int fd = OPTS.direct ? openat(dirfd, name, flags|O_DIRECT, mode) : -1;
+	if (!OPTS.direct || (fd == -1 && errno == EINVAL)) {
+		if (OPTS.direct && OPTS.verbose) fprintf(stdout, "O_DIRECT not supported for '%s', using page cache\n", name);
+		fd = openat(dirfd, name, flags, mode);
+	}
+	if (OPTS.stats) record_latency(OP_OPEN, start_ns);
+	return fd;
+}
+
+bool drop_direct(int fd) { // clear O_DIRECT, true if it was set
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || !(flags & O_DIRECT)) return false;
+	return fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+}
+
+ssize_t read_chunk(int fd, char *buf, size_t len) { // read() retrying interrupts, unaligned tail without O_DIRECT
+	uint64_t start_ns = OPTS.stats ? clock_ns() : 0;
+	while (1) {
+		ssize_t bytes_read = read(fd, buf, len);
+		if (bytes_read != -1) {
+			if (OPTS.stats) record_latency(OP_READ, start_ns);
+			return bytes_read;
+		}
+		if (errno == EINTR) continue;
+		if (errno == EINVAL && drop_direct(fd)) continue;
+		return -1;
+	}
+}
+
+ssize_t pread_chunk(int fd, char *buf, size_t len, off_t offset) { // read_chunk() at offset, file position unchanged
+	uint64_t start_ns = OPTS.stats ? clock_ns() : 0;
+	while (1) {
+		ssize_t bytes_read = pread(fd, buf, len, offset);
+		if (bytes_read != -1) {
+			if (OPTS.stats) record_latency(OP_READ, start_ns);
+			return bytes_read;
+		}
+		if (errno == EINTR) continue;
+		if (errno == EINVAL && drop_direct(fd)) continue;
+		return -1;
+	}
+}
+
+int write_full(int fd, const char *buf, size_t len) { // write() until len bytes written or error
+	size_t total_written = 0;
+	while (total_written < len) {
+		ssize_t bytes_written = write(fd, buf + total_written, len - total_written);
+		if (bytes_written == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EINVAL && drop_direct(fd)) continue; // unaligned tail of O_DIRECT file
+			return -1;
+		}
+		total_written += bytes_written;
+	}
+	return 0;
+}
+
+void count_read(enum Engine engine, size_t len, off_t file_done) { // source bytes read by an engine, file_done of current file for reporter thread
+	STATS.engines_used |= 1u << engine;
+	STATS.bytes_read += len;
+	if (OPTS.progress) PROGRESS.file_done = file_done;
+}
+
+void count_offloaded(const struct DestFile *dest, size_t len) { // written by FICLONE or copy_file_range(), not by an engine
+	STATS.bytes_offloaded += len;
+	STATS.dest_written[dest->index] += len;
+	STATS.dest_offloaded[dest->index] += len;
+}
+
+void count_written(const struct DestFile *dest, size_t len) {
+	STATS.bytes_written += len;
+	STATS.dest_written[dest->index] += len;
+}
+
+int write_dest(struct DestFile *dest, const char *buf, size_t len) { // write_full() throttled, timed and counted per destination
+	size_t slice = (OPTS.bufsize + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN; // aligned for --direct
+	if (len > slice && rate_limited(dest)) { // paced slice by slice, a whole mmap window would go out as one burst
+		for (size_t done = 0; done < len; done += slice) {
+			if (write_dest(dest, buf + done, len - done < slice ? len - done : slice) == -1) return -1;
+		}
+		return 0;
+	}
+	throttle(dest, len);
+	uint64_t start_ns = OPTS.stats ? clock_ns() : 0;
+	if (write_full(dest->fd, buf, len) == -1) {
+		restore_ioprio();
+		return -1;
+	}
+	if (OPTS.stats) STATS.dest_write_ns[dest->index] += record_latency(OP_WRITE, start_ns);
+	count_written(dest, len);
+	write_behind(dest, len);
+	restore_ioprio();
+	return 0;
+}
+
+int pwrite_dest(const struct DestFile *dest, const char *buf, size_t len, off_t offset) { // write_dest() at offset
+	throttle(dest, len);
+	uint64_t start_ns = OPTS.stats ? clock_ns() : 0;
+	size_t total_written = 0;
+	while (total_written < len) {
+		ssize_t bytes_written = pwrite(dest->fd, buf + total_written, len - total_written, offset + total_written);
+		if (bytes_written == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EINVAL && drop_direct(dest->fd)) continue; // unaligned tail of O_DIRECT file
+			restore_ioprio();
+			return -1;
+		}
+		total_written += bytes_written;
+	}
+	restore_ioprio();
+	if (OPTS.stats) STATS.dest_write_ns[dest->index] += record_latency(OP_WRITE, start_ns);
+	count_written(dest, len);
+	return 0;
+}
+
+int writev_dest(struct DestFile *dest, const struct iovec iov[], int iov_num) { // writev() until every buffer is written, throttled, timed and counted
+	size_t len = 0;
+	for (int i = 0; i < iov_num; i++) {
+		len += iov[i].iov_len;
+	}
+	throttle(dest, len);
+	uint64_t start_ns = OPTS.stats ? clock_ns() : 0;
+	struct iovec rest[iov_num]; // advanced past partial writes
+	memcpy(rest, iov, sizeof(rest));
+	size_t total_written = 0;
+	int pos = 0;
+	while (pos < iov_num) {
+		ssize_t bytes_written = writev(dest->fd, &rest[pos], iov_num - pos);
+		if (bytes_written == -1) {
+			if (errno == EINTR) continue;
+			if (errno == EINVAL && drop_direct(dest->fd)) continue; // unaligned tail of O_DIRECT file
+			restore_ioprio();
+			return -1;
+		}
+		total_written += bytes_written;
+		while (pos < iov_num && (size_t)bytes_written >= rest[pos].iov_len) {
+			bytes_written -= rest[pos].iov_len;
+			pos++;
+		}
+		if (pos < iov_num) {
+			rest[pos].iov_base = (char *)rest[pos].iov_base + bytes_written;
+			rest[pos].iov_len -= bytes_written;
+		}
+	}
+	if (OPTS.stats) STATS.dest_write_ns[dest->index] += record_latency(OP_WRITE, start_ns);
+	count_written(dest, total_written);
+	write_behind(dest, total_written);
+	restore_ioprio();
+	return 0;
+}
+
+void write_behind(struct DestFile *dest, size_t len) { // --sync=stream for destinations written at their file offset
+	if (OPTS.sync != SYNC_STREAM) return;
+	dest->dirty += len;
+	if (dest->dirty < SYNC_WINDOW) return;
+	dest->dirty = 0;
+	off_t pos = lseek(dest->fd, 0, SEEK_CUR); // holes of sparse copies move it too
+	if (pos != -1) flush_windows(dest->fd, dest->start, pos, &dest->flushed);
+}
+
+void flush_windows(int fd, off_t base, off_t end, off_t *flushed) {
+	// Starts writeback of every full SYNC_WINDOW between *flushed and end, then waits for the window before it
+	// and drops it from page cache. Writing continues while a window is written back, so the disk stays busy
+	// and dirty memory stays bounded. Errors are left to the final fsync() or syncfs() to report.
+	while (end - *flushed >= SYNC_WINDOW) {
+		sync_file_range(fd, *flushed, SYNC_WINDOW, SYNC_FILE_RANGE_WRITE);
+		if (*flushed - SYNC_WINDOW >= base) {
+			off_t previous = *flushed - SYNC_WINDOW;
+			sync_file_range(fd, previous, SYNC_WINDOW, SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+			posix_fadvise(fd, previous, SYNC_WINDOW, POSIX_FADV_DONTNEED);
+		}
+		*flushed += SYNC_WINDOW;
+	}
+}
+
+int sync_file(const struct DestFile *dest) { // --sync=file, before closing a written destination
+	uint64_t start_ns = OPTS.stats ? clock_ns() : 0;
+	if (fsync(dest->fd) == -1) {
+		fprintf(stderr, "%s: cannot sync '%s': %s\n", OPTS.name, dest_display(dest), strerror(errno));
+		STATS.errors++;
+		if (OPTS.fatal_errors) {return -1;} else {return 0;}
+	}
+	if (OPTS.stats) record_latency(OP_SYNC, start_ns);
+	return 0;
+}
+
+int sync_dests() { // --sync other than none, one syncfs() per filesystem holding destinations
+	for (int i = 0; i < OPTS.dest_num; i++) {
+		bool synced = false;
+		for (int j = 0; j < i; j++) {
+			if (OPTS.dest_dev[j] == OPTS.dest_dev[i]) synced = true;
+		}
+		if (synced) continue;
+		if (OPTS.verbose) fprintf(stdout, "Syncing filesystem of '%s'\n", OPTS.dest[i]);
+		uint64_t start_ns = OPTS.stats ? clock_ns() : 0;
+		int fd = open(OPTS.dest[i], O_RDONLY|O_NOCTTY);
+		if (fd == -1 || syncfs(fd) == -1) {
+			fprintf(stderr, "%s: cannot sync filesystem of '%s': %s\n", OPTS.name, OPTS.dest[i], strerror(errno));
+			if (fd != -1) close(fd);
+			STATS.errors++;
+			if (OPTS.fatal_errors) {return -1;} else {continue;}
+		}
+		close(fd);
+		if (OPTS.stats) record_latency(OP_SYNC, start_ns);
+	}
+	return 0;
+}
+
+double parse_rate(const char *str) { // bytes per second with optional K, M or G suffix, -1 if invalid
+	char *end;
+	double rate = strtod(str, &end);
+	if (end == str) return -1;
+	if (*end == 'K' || *end == 'k') {
+		rate *= 1024;
+		end++;
+	} else if (*end == 'M' || *end == 'm') {
+		rate *= 1024 * 1024;
+		end++;
+	} else if (*end == 'G' || *end == 'g') {
+		rate *= 1024 * 1024 * 1024;
+		end++;
+	}
+	return *end == '\0' ? rate : -1;
+}
+
+int parse_ioprio(const char *str) { // CLASS[:LEVEL] to ioprio_set() value, -1 if invalid
+	static const char *classes[] = {"realtime", "best-effort", "idle"}; // classes 1 to 3
+	const char *colon = strchr(str, ':');
+	size_t name_len = colon != NULL ? (size_t)(colon - str) : strlen(str);
+	int class = 0;
+	for (int i = 0; i < 3; i++) {
+		if (strlen(classes[i]) == name_len && strncmp(str, classes[i], name_len) == 0) class = i + 1;
+	}
+	if (class == 0) return -1;
+	int level = 4; // kernel default for best-effort
+	if (colon != NULL) {
+		char *end;
+		level = strtol(colon + 1, &end, 10);
+		if (end == colon + 1 || *end != '\0' || level < 0 || level > 7) return -1;
+	}
+	if (class == 3) level = 0; // idle has no levels
+	return class << IOPRIO_CLASS_SHIFT | level;
+}
+
+int dest_prefix(const char *spec, const char **value) { // N of 'N=VALUE', 0 without prefix, INT_MAX if N is invalid
+	*value = spec;
+	const char *equals = strchr(spec, '=');
+	if (equals == NULL) return 0;
+	char *end;
+	long dest = strtol(spec, &end, 10);
+	if (end != equals || end == spec || dest < 1 || dest > INT_MAX) return INT_MAX; // rejected by caller
+	*value = equals + 1;
+	return dest;
+}
+
+int set_ioprio(int ioprio) { // for the calling thread, threads it starts inherit it
+	return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio);
+}
+
+uint64_t bucket_take(struct Bucket *bucket, size_t len) { // start time for writing len bytes at bucket rate
+	if (bucket->rate <= 0) return 0;
+	pthread_mutex_lock(&bucket->lock);
+	uint64_t now = clock_ns();
+	if (bucket->next_ns < now) bucket->next_ns = now; // bucket holds one write at most
+	uint64_t start_ns = bucket->next_ns;
+	bucket->next_ns += len * 1e9 / bucket->rate;
+	pthread_mutex_unlock(&bucket->lock);
+	return start_ns;
+}
+
+bool rate_limited(const struct DestFile *dest) { // --bwlimit applies to dest, or to any destination if NULL
+	if (LIMITS.total.rate > 0) return true;
+	if (dest == NULL) return LIMITS.dests != NULL;
+	return LIMITS.dests != NULL && LIMITS.dests[dest->index].rate > 0;
+}
+
+void throttle(const struct DestFile *dest, size_t len) { // waits for --bwlimit, switches to --ionice of dest until restore_ioprio()
+	uint64_t start_ns = bucket_take(&LIMITS.total, len);
+	if (LIMITS.dests != NULL) {
+		uint64_t dest_start_ns = bucket_take(&LIMITS.dests[dest->index], len);
+		if (dest_start_ns > start_ns) start_ns = dest_start_ns;
+	}
+	if (start_ns > 0) {
+		struct timespec until = {start_ns / 1000000000, start_ns % 1000000000};
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+	}
+	if (LIMITS.dest_ioprio != NULL) switch_ioprio(LIMITS.dest_ioprio[dest->index]);
+}
+
+void switch_ioprio(int ioprio) { // set_ioprio() for the calling thread when it changes
+	static _Thread_local int thread_ioprio = -1; // last set by this thread
+	if (ioprio != thread_ioprio && set_ioprio(ioprio) == 0) thread_ioprio = ioprio;
+}
+
+void restore_ioprio() { // after a write throttled with a destination priority, so reads keep the process one
+	if (LIMITS.dest_ioprio != NULL) switch_ioprio(LIMITS.process_ioprio);
+}
+
+int close_timed(int fd) {
+	uint64_t start_ns = OPTS.stats ? clock_ns() : 0;
+	int result = close(fd);
+	if (OPTS.stats) record_latency(OP_CLOSE, start_ns);
+	return result;
+}
+
+uint64_t clock_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+uint64_t record_latency(enum Op op, uint64_t start_ns) { // returns latency in nanoseconds
+	uint64_t latency_ns = clock_ns() - start_ns;
+	int bucket = 0;
+	for (uint64_t us = latency_ns / 1000; us > 0 && bucket < LATENCY_BUCKETS - 1; us >>= 1) {
+		bucket++;
+	}
+	STATS.latency[op].count++;
+	STATS.latency[op].total_ns += latency_ns;
+	STATS.latency[op].buckets[bucket]++;
+	return latency_ns;
+}
+
+void print_progress(double rate, double average_rate, const double dest_rates[]) {
+	// rate - source bytes per second since last redraw, average_rate - since start, for ETA
+	char line[1024];
+	int len = 0;
+	off_t remaining = -1;
+	if (OPTS.global_progress) {
+		char *str_read = human_readable(STATS.bytes_read);
+		if (STATS.str_total_size == NULL) { // streamed source, total is unknown until it ends
+			len += snprintf(line + len, sizeof(line) - len, "%s, files (%i/%i)", str_read, STATS.copied_files, STATS.total_files);
+		} else {
+			double total_percent_copied = STATS.total_size ? ((float)STATS.bytes_read / (float)STATS.total_size) * 100 : 100;
+			len += snprintf(line + len, sizeof(line) - len, "%3.0f%% (%s/%s), files (%i/%i)",
+							total_percent_copied, str_read, STATS.str_total_size, STATS.copied_files, STATS.total_files);
+			remaining = STATS.total_size > STATS.bytes_read ? STATS.total_size - STATS.bytes_read : 0;
+		}
+		free(str_read);
+	}
+	if (OPTS.progress) {
+		off_t file_size = PROGRESS.file_size;
+		if (file_size < 0) { // stream, bytes so far instead of percent
+			char *str_done = human_readable(PROGRESS.file_done);
+			len += snprintf(line + len, sizeof(line) - len, " File progress: %s", str_done);
+			free(str_done);
+		} else {
+			double persent_copied = file_size ? ((float)PROGRESS.file_done / (float)file_size) * 100 : 100;
+			len += snprintf(line + len, sizeof(line) - len, " File progress:%3.0f%%", persent_copied);
+			if (remaining == -1) remaining = file_size > PROGRESS.file_done ? file_size - PROGRESS.file_done : 0;
+		}
+	}
+	char *str_rate = human_readable(rate);
+	len += snprintf(line + len, sizeof(line) - len, ", %s/s", str_rate);
+	free(str_rate);
+	if (average_rate > 0 && remaining >= 0) {
+		long eta = remaining / average_rate;
+		len += snprintf(line + len, sizeof(line) - len, ", ETA %li:%02li:%02li", eta / 3600, eta / 60 % 60, eta % 60);
+	}
+	if (OPTS.dest_num > 1) { // a lagging destination shows up here
+		len += snprintf(line + len, sizeof(line) - len, ", destinations:");
+		for (int i = 0; i < OPTS.dest_num && len < (int)sizeof(line); i++) {
+			str_rate = human_readable(dest_rates[i]);
+			len += snprintf(line + len, sizeof(line) - len, " %s/s", str_rate);
+			free(str_rate);
+		}
+	}
+	if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+	fprintf(stdout, "\r%s%*s", line, PROGRESS.line_len > len ? PROGRESS.line_len - len : 0, "");
+	fflush(stdout);
+	PROGRESS.line_len = len;
+}
+
+void *progress_thread(void *arg) {
+	// Redraws progress line every PROGRESS_INTERVAL_MS until stop_progress(), state is in PROGRESS
+	(void)arg;
+	struct timespec start, last, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last = start;
+	size_t last_read = STATS.bytes_read;
+	size_t last_written[OPTS.dest_num];
+	double dest_rates[OPTS.dest_num];
+	for (int i = 0; i < OPTS.dest_num; i++) {
+		last_written[i] = STATS.dest_written[i];
+	}
+	size_t start_read = last_read;
+
+	pthread_mutex_lock(&PROGRESS.lock);
+	while (PROGRESS.running) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += PROGRESS_INTERVAL_MS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&PROGRESS.wakeup, &PROGRESS.lock, &deadline);
+		if (!PROGRESS.running) break;
+		pthread_mutex_unlock(&PROGRESS.lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double interval = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+		double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+		size_t bytes_read = STATS.bytes_read;
+		for (int i = 0; i < OPTS.dest_num; i++) {
+			size_t written = STATS.dest_written[i];
+			dest_rates[i] = (written - last_written[i]) / interval;
+			last_written[i] = written;
+		}
+		print_progress((bytes_read - last_read) / interval, (bytes_read - start_read) / elapsed, dest_rates);
+		last_read = bytes_read;
+		last = now;
+
+		pthread_mutex_lock(&PROGRESS.lock);
+	}
+	pthread_mutex_unlock(&PROGRESS.lock);
+	return NULL;
+}
+
+void start_progress() {
+	if (!OPTS.progress && !OPTS.global_progress) return;
+	pthread_mutex_init(&PROGRESS.lock, NULL);
+	pthread_cond_init(&PROGRESS.wakeup, NULL);
+	PROGRESS.running = true;
+	PROGRESS.line_len = 0;
+	int err = pthread_create(&PROGRESS.thread, NULL, progress_thread, NULL);
+	if (err != 0) {
+		fprintf(stderr, "%s: cannot create progress thread: %s\n", OPTS.name, strerror(err));
+		PROGRESS.running = false;
+	}
+}
+
+void stop_progress() { // clears progress line
+	if (!PROGRESS.running) return;
+	pthread_mutex_lock(&PROGRESS.lock);
+	PROGRESS.running = false;
+	pthread_cond_signal(&PROGRESS.wakeup);
+	pthread_mutex_unlock(&PROGRESS.lock);
+	pthread_join(PROGRESS.thread, NULL);
+	fprintf(stdout, "\r%*s\r", PROGRESS.line_len, "");
+	fflush(stdout);
+}
+
+int copy_data(int source_fd, const char *source_path, const struct stat *source_stat, struct DestFile dests[], int dest_num, off_t length, uint32_t *crc) {
+	// Copy length bytes, or until source ends if length is -1, from current offsets of source and destinations
+	// Destinations on independent disks are written in parallel by auto engine too
+	bool stream = !S_ISREG(source_stat->st_mode); // size unknown, can't be mapped or read at offsets
+	bool threaded = dest_num > 1 && (OPTS.engine == ENGINE_THREADS ||
+			(OPTS.engine == ENGINE_AUTO && (count_devices(dests, dest_num) > 1 || share_rotational(dests, dest_num))));
+	if (OPTS.direct) { // chunks aligned and sized to a multiple of the filesystem block
+		size_t align = source_stat->st_blksize > DIRECT_ALIGN ? source_stat->st_blksize : DIRECT_ALIGN;
+		size_t chunk_size = (OPTS.bufsize + align - 1) / align * align;
+		if (threaded) {
+			return copy_data_threaded(source_fd, source_path, dests, dest_num, RING_CHUNKS, chunk_size, true, length, crc);
+		} else { // one writer for all destinations, reads one chunk ahead of it
+			return copy_data_threaded(source_fd, source_path, dests, dest_num, 2, chunk_size, false, length, crc);
+		}
+	} else if (threaded && (stream || (length < 0 ? source_stat->st_size : length) > (off_t)OPTS.bufsize)) {
+		return copy_data_threaded(source_fd, source_path, dests, dest_num, RING_CHUNKS, OPTS.bufsize, true, length, crc);
+#ifdef HAVE_IO_URING
+	} else if (OPTS.engine == ENGINE_URING && crc == NULL && !stream) { // completes out of order, can't checksum a stream
+		return copy_data_uring(source_fd, source_path, source_stat, dests, dest_num, length);
+#endif
+	} else if (OPTS.engine == ENGINE_MMAP && !stream) {
+		return copy_data_mmap(source_fd, source_path, source_stat, dests, dest_num, length, crc);
+	} else if ((OPTS.engine == ENGINE_AUTO || OPTS.engine == ENGINE_SPLICE || (stream && OPTS.engine != ENGINE_RW)) && crc == NULL) {
+		// data never reaches user memory
+		return copy_data_splice(source_fd, source_path, dests, dest_num, length);
+	} else { // threads don't pay off for a single destination or a single chunk
+		return copy_data_rw(source_fd, source_path, dests, dest_num, length, crc);
+	}
+}
+
+int copy_data_sparse(int source_fd, const char *source_path, const struct stat *source_stat, struct DestFile dests[], int dest_num, off_t start, uint32_t *crc) {
+	// Copy data segments only, destinations get holes by seeking over them and truncating to source size
+	off_t size = source_stat->st_size;
+	off_t data_end = start; // end of last data segment
+	while (data_end < size) {
+		off_t data = lseek(source_fd, data_end, SEEK_DATA);
+		if (data == -1) {
+			if (errno == ENXIO) break; // only a hole is left
+			if (data_end == start && lseek(source_fd, start, SEEK_SET) == start) { // filesystem can't report holes
+				return copy_data(source_fd, source_path, source_stat, dests, dest_num, -1, crc);
+			}
+			fprintf(stderr, "%s: cannot find data in '%s': %s\n", OPTS.name, source_path, strerror(errno));
+			STATS.errors++;
+			if (OPTS.fatal_errors) {return -1;} else {return 0;}
+		}
+		off_t hole = lseek(source_fd, data, SEEK_HOLE);
+		if (hole == -1 || lseek(source_fd, data, SEEK_SET) == -1) {
+			fprintf(stderr, "%s: cannot find hole in '%s': %s\n", OPTS.name, source_path, strerror(errno));
+			STATS.errors++;
+			if (OPTS.fatal_errors) {return -1;} else {return 0;}
+		}
+		STATS.bytes_holes += data - data_end;
+		if (crc != NULL) *crc = crc32c_zeros(*crc, data - data_end);
+		for (int i = 0; i < dest_num; i++) {
+			if (lseek(dests[i].fd, data, SEEK_SET) == -1) {
+				fprintf(stderr, "%s: cannot seek in '%s': %s\n", OPTS.name, dest_display(&dests[i]), strerror(errno));
+				STATS.errors++;
+				if (OPTS.fatal_errors) {return -1;} else {return 0;}
+			}
+			if (OPTS.allocate) { // only data segments, holes stay unallocated
+				int err = posix_fallocate(dests[i].fd, data, hole - data);
+				if (err != 0) {
+					fprintf(stderr, "%s: cannot allocate space for '%s': %s\n", OPTS.name, dest_display(&dests[i]), strerror(err));
+					STATS.errors++;
+					if (OPTS.fatal_errors) {return -1;} else {return 0;}
+				}
+			}
+		}
+		int copy_result = copy_data(source_fd, source_path, source_stat, dests, dest_num, hole - data, crc);
+		if (copy_result != 0) return copy_result;
+		data_end = hole;
+	}
+	if (size > data_end) {
+		STATS.bytes_holes += size - data_end;
+		if (crc != NULL) *crc = crc32c_zeros(*crc, size - data_end);
+	}
+
+	// Trailing hole
+	for (int i = 0; i < dest_num; i++) {
+		if (ftruncate(dests[i].fd, size) == -1) {
+			fprintf(stderr, "%s: cannot truncate '%s': %s\n", OPTS.name, dest_display(&dests[i]), strerror(errno));
+			STATS.errors++;
+			if (OPTS.fatal_errors) {return -1;} else {return 0;}
+		}
+	}
+	return 0;
+}
+
+int copy_data_rw(int source_fd, const char *source_path, struct DestFile dests[], int dest_num, off_t length, uint32_t *crc) {
+	if (ENGINES.rw_buf == NULL) { // heap allocated once, large buffer sizes don't fit on the stack
+		ENGINES.rw_buf = malloc(OPTS.bufsize);
+		if (ENGINES.rw_buf == NULL) {
+			fprintf(stderr, "%s: cannot allocate %lu bytes buffer: %s\n", OPTS.name, OPTS.bufsize, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	off_t total_read = 0;
+	while (length < 0 || total_read < length) {
+		size_t chunk_size = OPTS.bufsize;
+		if (length >= 0 && (off_t)chunk_size > length - total_read) chunk_size = length - total_read;
+		ssize_t bytes_read = read_chunk(source_fd, ENGINES.rw_buf, chunk_size);
+		if (bytes_read == -1) {
+			fprintf(stderr, "%s: error reading %s: %s\n", OPTS.name, source_path, strerror(errno));
+			STATS.errors++;
+			if (OPTS.fatal_errors) {return -1;} else {return 0;}
+		}
+		if (!bytes_read) break; // Source file ended
+		total_read += bytes_read;
+		count_read(ENGINE_RW, bytes_read, total_read);
+		if (crc != NULL) *crc = crc32c(*crc, ENGINES.rw_buf, bytes_read);
+
+		for (int i = 0; i < dest_num; i++) {
+			if (write_dest(&dests[i], ENGINES.rw_buf, bytes_read) == -1) {
+				fprintf(stderr, "%s: error writing %s: %s\n", OPTS.name, dest_display(&dests[i]), strerror(errno));
+				STATS.errors++;
+				if (OPTS.fatal_errors) {return -1;} else {return 0;}
+			}
+		}
+	}
+	return 0;
+}
+
+void *writer_thread(void *arg) {
+	struct Writer *writer = arg;
+	struct Ring *ring = writer->ring;
+	unsigned long pos = 0; // next chunk to write
+	pthread_mutex_lock(&ring->lock);
+	while (1) {
+		// Batch is at most half of the ring, so reader can fill it while the other half is written
+		while (ring->head - pos < (unsigned long)writer->batch && !ring->eof) {
+			pthread_cond_wait(&ring->filled, &ring->lock);
+		}
+		int chunk_num = ring->head - pos;
+		if (chunk_num == 0) break; // reader finished and every chunk is written
+		if (chunk_num > writer->batch) chunk_num = writer->batch;
+		struct iovec iov[chunk_num];
+		for (int i = 0; i < chunk_num; i++) {
+			struct Chunk *chunk = &ring->chunks[(pos + i) % ring->chunk_num];
+			iov[i].iov_base = chunk->buf;
+			iov[i].iov_len = chunk->len;
+		}
+		pthread_mutex_unlock(&ring->lock);
+
+		// Destinations sharing a disk get the whole batch in turn, one long sequential write each
+		for (int i = 0; i < writer->dest_num; i++) {
+			struct DestFile *dest = writer->dests[i];
+			if (dest->failed) continue; // failed destination keeps releasing chunks so reader is not blocked
+			if (writev_dest(dest, iov, chunk_num) == -1) {
+				fprintf(stderr, "%s: error writing %s: %s\n", OPTS.name, dest_display(dest), strerror(errno));
+				dest->failed = true;
+			}
+		}
+
+		pthread_mutex_lock(&ring->lock);
+		for (int i = 0; i < chunk_num; i++) {
+			struct Chunk *chunk = &ring->chunks[(pos + i) % ring->chunk_num];
+			if (--chunk->refs == 0) pthread_cond_signal(&ring->drained);
+		}
+		pos += chunk_num;
+	}
+	pthread_mutex_unlock(&ring->lock);
+	return NULL;
+}
+
+int copy_data_threaded(int source_fd, const char *source_path, struct DestFile dests[], int dest_num,
+		int chunk_num, size_t chunk_size, bool per_device, off_t length, uint32_t *crc) {
+	// With per_device every destination gets its own writer, except destinations on one rotational disk share one,
+	// otherwise a single writer writes each chunk to all destinations in turn
+	struct Ring *ring = &ENGINES.ring; // buffers are reused between files
+	if (ENGINES.ring_size == 0) {
+		pthread_mutex_init(&ring->lock, NULL);
+		pthread_cond_init(&ring->filled, NULL);
+		pthread_cond_init(&ring->drained, NULL);
+	}
+
+	// Writer of a rotational disk takes ROTATIONAL_BATCH bytes at once, the ring holds two batches
+	int batch = ROTATIONAL_BATCH / chunk_size;
+	if (batch < 1 || rate_limited(NULL)) batch = 1; // --bwlimit paces chunk by chunk, a batch would be one burst
+	if (batch > IOV_MAX) batch = IOV_MAX; // one writev()
+	for (int i = 0; per_device && i < dest_num; i++) {
+		if (OPTS.group_rotational[OPTS.dest_group[dests[i].index]] && chunk_num < 2 * batch) chunk_num = 2 * batch;
+	}
+	if (chunk_size > ENGINES.ring_size || chunk_num > ring->chunk_cap) { // aligned for O_DIRECT
+		for (int i = 0; i < ring->chunk_cap; i++) {
+			free(ring->chunks[i].buf);
+		}
+		free(ring->chunks);
+		if (chunk_size > ENGINES.ring_size) ENGINES.ring_size = chunk_size;
+		if (chunk_num > ring->chunk_cap) ring->chunk_cap = chunk_num;
+		ring->chunks = calloc(ring->chunk_cap, sizeof(struct Chunk));
+		for (int i = 0; ring->chunks != NULL && i < ring->chunk_cap; i++) {
+			if (posix_memalign((void **)&ring->chunks[i].buf, DIRECT_ALIGN, ENGINES.ring_size) != 0) ring->chunks[i].buf = NULL;
+			if (ring->chunks[i].buf == NULL) {
+				fprintf(stderr, "%s: cannot allocate ring buffer: %s\n", OPTS.name, strerror(ENOMEM));
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (ring->chunks == NULL) {
+			fprintf(stderr, "%s: cannot allocate ring buffer: %s\n", OPTS.name, strerror(ENOMEM));
+			exit(EXIT_FAILURE);
+		}
+	}
+	ring->chunk_num = chunk_num;
+	ring->head = 0;
+	ring->eof = false;
+	for (int i = 0; i < chunk_num; i++) {
+		ring->chunks[i].refs = 0;
+	}
+
+	// Queueing destinations to writers
+	struct DestFile *queue[dest_num]; // destinations ordered by writer
+	struct Writer writers[dest_num];
+	int writer_num = 0;
+	int queued = 0;
+	for (int i = 0; i < dest_num; i++) {
+		int group = OPTS.dest_group[dests[i].index];
+		bool rotational = per_device && OPTS.group_rotational[group];
+		if (queued == dest_num) break; // single writer took every destination
+		if (rotational) { // already queued with first destination on the disk
+			int j = 0;
+			while (j < i && OPTS.dest_group[dests[j].index] != group) j++;
+			if (j < i) continue;
+		}
+		struct Writer *writer = &writers[writer_num++];
+		writer->ring = ring;
+		writer->dests = &queue[queued];
+		writer->batch = rotational ? batch : 1;
+		for (int j = i; j < dest_num; j++) {
+			if (j == i || !per_device || (rotational && OPTS.dest_group[dests[j].index] == group)) queue[queued++] = &dests[j];
+		}
+		writer->dest_num = &queue[queued] - writer->dests;
+	}
+
+	// Starting writers, if one can't be started nothing is read and every destination is copied by rw engine
+	int writers_started = 0;
+	int start_error = 0;
+	for (int i = 0; i < writer_num; i++) {
+		start_error = pthread_create(&writers[i].thread, NULL, writer_thread, &writers[i]);
+		if (start_error != 0) break;
+		writers_started++;
+	}
+
+	// Reading source into the ring
+	int read_error = 0;
+	off_t total_read = 0;
+	while (writers_started == writer_num && (length < 0 || total_read < length)) {
+		pthread_mutex_lock(&ring->lock);
+		struct Chunk *chunk = &ring->chunks[ring->head % ring->chunk_num];
+		while (chunk->refs > 0) { // wait until every writer is done with this chunk
+			pthread_cond_wait(&ring->drained, &ring->lock);
+		}
+		pthread_mutex_unlock(&ring->lock);
+
+		size_t read_size = chunk_size;
+		if (length >= 0 && (off_t)read_size > length - total_read) read_size = length - total_read;
+		ssize_t bytes_read = read_chunk(source_fd, chunk->buf, read_size);
+		if (bytes_read == -1) {
+			read_error = errno;
+			break;
+		}
+		if (!bytes_read) break; // Source file ended
+		total_read += bytes_read;
+		count_read(ENGINE_THREADS, bytes_read, total_read);
+		if (crc != NULL) *crc = crc32c(*crc, chunk->buf, bytes_read);
+
+		pthread_mutex_lock(&ring->lock);
+		chunk->len = bytes_read;
+		chunk->refs = writer_num;
+		ring->head++;
+		pthread_cond_broadcast(&ring->filled);
+		pthread_mutex_unlock(&ring->lock);
+	}
+
+	// Stopping writers
+	pthread_mutex_lock(&ring->lock);
+	ring->eof = true;
+	pthread_cond_broadcast(&ring->filled);
+	pthread_mutex_unlock(&ring->lock);
+	int failed = 0;
+	for (int i = 0; i < writers_started; i++) {
+		pthread_join(writers[i].thread, NULL);
+	}
+	if (start_error != 0) {
+		if (OPTS.verbose) fprintf(stdout, "Cannot create writer thread (%s), using rw engine\n", strerror(start_error));
+		return copy_data_rw(source_fd, source_path, dests, dest_num, length, crc);
+	}
+	for (int i = 0; i < dest_num; i++) {
+		if (dests[i].failed) failed++;
+	}
+
+	if (read_error) {
+		fprintf(stderr, "%s: error reading %s: %s\n", OPTS.name, source_path, strerror(read_error));
+		failed++;
+	}
+	if (failed) {
+		STATS.errors += failed;
+		if (OPTS.fatal_errors) {return -1;} else {return 0;}
+	}
+	return 0;
+}
+
+void *range_thread(void *arg) {
+	struct Ranges *ranges = arg;
+	char *buf;
+	if (posix_memalign((void **)&buf, DIRECT_ALIGN, ranges->chunk_size) != 0) { // aligned for O_DIRECT
+		fprintf(stderr, "%s: cannot allocate %lu bytes buffer: %s\n", OPTS.name, ranges->chunk_size, strerror(ENOMEM));
+		exit(EXIT_FAILURE);
+	}
+	while (ranges->read_error == 0) {
+		off_t offset = ranges->start + ranges->next++ * SPLIT_RANGE;
+		if (offset >= ranges->size) break;
+		off_t end = offset + SPLIT_RANGE < ranges->size ? offset + SPLIT_RANGE : ranges->size;
+		off_t base = offset;
+		off_t flushed = offset; // --sync=stream, ranges are written back each by its own thread
+		while (offset < end && ranges->read_error == 0) {
+			size_t len = (off_t)ranges->chunk_size < end - offset ? ranges->chunk_size : (size_t)(end - offset);
+			ssize_t bytes_read = pread_chunk(ranges->source_fd, buf, len, offset);
+			if (bytes_read == -1) {
+				int expected = 0;
+				atomic_compare_exchange_strong(&ranges->read_error, &expected, errno);
+				break;
+			}
+			if (!bytes_read) break; // source was truncated while copying
+			STATS.bytes_read += bytes_read;
+			STATS.engines_used |= 1u << ENGINE_RW; // ranges are read and written like rw engine
+
+			for (int i = 0; i < ranges->dest_num; i++) {
+				struct DestFile *dest = &ranges->dests[i];
+				if (ranges->failed[i]) continue;
+				if (pwrite_dest(dest, buf, bytes_read, offset) == -1) {
+					fprintf(stderr, "%s: error writing %s: %s\n", OPTS.name, dest_display(dest), strerror(errno));
+					ranges->failed[i] = true;
+				}
+			}
+			offset += bytes_read;
+			if (OPTS.progress) PROGRESS.file_done += bytes_read; // ranges finish in any order, progress is their sum
+			if (OPTS.sync == SYNC_STREAM && offset - flushed >= SYNC_WINDOW) {
+				for (int i = 0; i < ranges->dest_num; i++) {
+					off_t dest_flushed = flushed;
+					if (!ranges->failed[i]) flush_windows(ranges->dests[i].fd, base, offset, &dest_flushed);
+				}
+				flushed += (offset - flushed) / SYNC_WINDOW * SYNC_WINDOW;
+			}
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+int copy_data_split(int source_fd, const char *source_path, const struct stat *source_stat, struct DestFile dests[], int dest_num, off_t start) {
+	// Copy source from start to its end in SPLIT_RANGE ranges with OPTS.split threads, calling thread is one of them
+	atomic_bool failed[dest_num];
+	struct Ranges ranges = {
+		.source_fd = source_fd,
+		.dests = dests,
+		.dest_num = dest_num,
+		.failed = failed,
+		.size = source_stat->st_size,
+		.start = start,
+		.chunk_size = OPTS.bufsize,
+		.next = 0,
+		.read_error = 0,
+	};
+	if (OPTS.direct) { // chunks aligned and sized to a multiple of the filesystem block
+		size_t align = source_stat->st_blksize > DIRECT_ALIGN ? source_stat->st_blksize : DIRECT_ALIGN;
+		ranges.chunk_size = (OPTS.bufsize + align - 1) / align * align;
+	}
+	for (int i = 0; i < dest_num; i++) {
+		failed[i] = false;
+		// Ranges are written out of order, allocating first keeps extents contiguous
+		if (OPTS.allocate && start == 0) continue; // already allocated
+		int err = posix_fallocate(dests[i].fd, start, ranges.size - start);
+		if (err != 0 && OPTS.verbose) fprintf(stdout, "Cannot allocate space for '%s' (%s), writing ranges anyway\n", dest_display(&dests[i]), strerror(err));
+	}
+
+	long range_num = (ranges.size - start + SPLIT_RANGE - 1) / SPLIT_RANGE;
+	int thread_num = OPTS.split < range_num ? OPTS.split : range_num;
+	pthread_t threads[thread_num];
+	int threads_started = 0;
+	for (int i = 1; i < thread_num; i++) {
+		int err = pthread_create(&threads[i], NULL, range_thread, &ranges);
+		if (err != 0) { // remaining threads pick up the ranges
+			if (OPTS.verbose) fprintf(stdout, "cannot create range thread for '%s': %s\n", source_path, strerror(err));
+			break;
+		}
+		threads_started++;
+	}
+	range_thread(&ranges);
+	for (int i = 1; i <= threads_started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	int failed_num = 0;
+	for (int i = 0; i < dest_num; i++) {
+		if (failed[i]) {
+			dests[i].failed = true;
+			failed_num++;
+		}
+	}
+	if (ranges.read_error) {
+		fprintf(stderr, "%s: error reading %s: %s\n", OPTS.name, source_path, strerror(ranges.read_error));
+		failed_num++;
+	}
+	if (failed_num) {
+		STATS.errors += failed_num;
+		if (OPTS.fatal_errors) {return -1;} else {return 0;}
+	}
+	return 0;
+}
+
+int copy_data_mmap(int source_fd, const char *source_path, const struct stat *source_stat, struct DestFile dests[], int dest_num, off_t length, uint32_t *crc) {
+	off_t start = lseek(source_fd, 0, SEEK_CUR); // destinations are at the same offset
+	off_t size = (length < 0) ? source_stat->st_size : start + length;
+	off_t offset = start;
+	long page_size = sysconf(_SC_PAGESIZE);
+	while (offset < size) {
+		size_t len = MMAP_WINDOW;
+		if ((off_t)len > size - offset) len = size - offset;
+		size_t skip = offset % page_size; // mapping starts on a page boundary
+		char *mapping = mmap(NULL, len + skip, PROT_READ, MAP_SHARED, source_fd, offset - skip);
+		char *window = mapping + skip;
+		if (mapping == MAP_FAILED) {
+			if (offset == start) { // filesystem can't map, nothing written yet
+				if (OPTS.verbose) fprintf(stdout, "cannot mmap '%s' (%s), using rw engine\n", source_path, strerror(errno));
+				return copy_data_rw(source_fd, source_path, dests, dest_num, length, crc);
+			}
+			fprintf(stderr, "%s: cannot mmap %s: %s\n", OPTS.name, source_path, strerror(errno));
+			STATS.errors++;
+			if (OPTS.fatal_errors) {return -1;} else {return 0;}
+		}
+		madvise(window, len, MADV_SEQUENTIAL);
+		madvise(window, len, MADV_HUGEPAGE); // only a hint, not every filesystem has large folios
+		count_read(ENGINE_MMAP, len, offset + len - start);
+		if (crc != NULL) *crc = crc32c(*crc, window, len);
+
+		for (int i = 0; i < dest_num; i++) {
+			if (write_dest(&dests[i], window, len) == -1) {
+				fprintf(stderr, "%s: error writing %s: %s\n", OPTS.name, dest_display(&dests[i]), strerror(errno));
+				munmap(mapping, len + skip);
+				STATS.errors++;
+				if (OPTS.fatal_errors) {return -1;} else {return 0;}
+			}
+		}
+		munmap(mapping, len + skip); // keep resident memory bounded to one window
+		offset += len;
+	}
+
+	// Copy whatever was appended to source after stat
+	if (lseek(source_fd, size, SEEK_SET) == -1) return 0;
+	if (length >= 0) return 0;
+	return copy_data_rw(source_fd, source_path, dests, dest_num, length, crc);
+}
+
+int splice_full(int in_fd, int out_fd, size_t len) { // splice() until len bytes moved, in_fd or out_fd is a pipe
+	while (len > 0) {
+		ssize_t moved = splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE);
+		if (moved == -1) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		if (moved == 0) {
+			errno = EIO; // in_fd ended before len bytes
+			return -1;
+		}
+		len -= moved;
+	}
+	return 0;
+}
+
+void close_pipes(int *pipes, int pipe_num) {
+	for (int i = 0; i < 2 * pipe_num; i++) {
+		close(pipes[i]);
+	}
+}
+
+void free_engines() { // releases ENGINES of the calling thread, engines set up again if it copies more
+	free(ENGINES.rw_buf);
+	free(ENGINES.delta_source);
+	free(ENGINES.delta_dest);
+	if (ENGINES.ring_size > 0) {
+		for (int i = 0; i < ENGINES.ring.chunk_cap; i++) {
+			free(ENGINES.ring.chunks[i].buf);
+		}
+		free(ENGINES.ring.chunks);
+		pthread_mutex_destroy(&ENGINES.ring.lock);
+		pthread_cond_destroy(&ENGINES.ring.filled);
+		pthread_cond_destroy(&ENGINES.ring.drained);
+	}
+	if (ENGINES.pipes != NULL) {
+		close_pipes(ENGINES.pipes, OPTS.dest_num);
+		free(ENGINES.pipes);
+	}
+	bool splice_unsupported = ENGINES.splice_unsupported; // not probed again
+#ifdef HAVE_IO_URING
+	if (ENGINES.uring_state == 1) uring_free(&ENGINES.uring);
+	int uring_state = (ENGINES.uring_state == -1) ? -1 : 0;
+#endif
+	memset(&ENGINES, 0, sizeof(ENGINES));
+	ENGINES.splice_unsupported = splice_unsupported;
+#ifdef HAVE_IO_URING
+	ENGINES.uring_state = uring_state;
+#endif
+}
+
+int copy_data_splice(int source_fd, const char *source_path, struct DestFile dests[], int dest_num, off_t length) {
+	// Pipe 0 is filled from source and drained into the last destination,
+	// pipes 1..dest_num-1 get a tee() of pipe 0 and are drained into the other destinations
+	if (ENGINES.splice_unsupported) return copy_data_rw(source_fd, source_path, dests, dest_num, length, NULL);
+	if (ENGINES.pipes == NULL) {
+		ENGINES.pipes = malloc(2 * OPTS.dest_num * sizeof(int));
+		ENGINES.pipe_chunk = SPLICE_PIPE_SIZE;
+		for (int i = 0; i < OPTS.dest_num; i++) {
+			if (pipe2(&ENGINES.pipes[2 * i], O_CLOEXEC) == -1) {
+				fprintf(stderr, "%s: cannot create pipe: %s\n", OPTS.name, strerror(errno));
+				close_pipes(ENGINES.pipes, i);
+				free(ENGINES.pipes);
+				ENGINES.pipes = NULL;
+				return copy_data_rw(source_fd, source_path, dests, dest_num, length, NULL);
+			}
+			// Every pipe has to hold a whole chunk for tee() to duplicate it at once
+			fcntl(ENGINES.pipes[2 * i + 1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE); // best effort, may be capped
+			int pipe_size = fcntl(ENGINES.pipes[2 * i + 1], F_GETPIPE_SZ);
+			if (pipe_size > 0 && (size_t)pipe_size < ENGINES.pipe_chunk) ENGINES.pipe_chunk = pipe_size;
+		}
+	}
+
+	off_t start = lseek(source_fd, 0, SEEK_CUR); // destinations are at the same offset
+	off_t total_read = 0;
+	int error = 0;
+	const char *error_path = NULL;
+	while (!error && (length < 0 || total_read < length)) {
+		size_t read_size = ENGINES.pipe_chunk;
+		if (read_size > OPTS.bufsize && rate_limited(NULL)) read_size = OPTS.bufsize; // paced chunk by chunk like other engines
+		if (length >= 0 && (off_t)read_size > length - total_read) read_size = length - total_read;
+		uint64_t start_ns = OPTS.stats ? clock_ns() : 0;
+		ssize_t bytes_read = splice(source_fd, NULL, ENGINES.pipes[1], NULL, read_size, SPLICE_F_MOVE);
+		if (OPTS.stats) record_latency(OP_READ, start_ns);
+		if (bytes_read == -1) {
+			if (errno == EINTR) continue;
+			error = errno;
+			error_path = source_path;
+			break;
+		}
+		if (!bytes_read) break; // Source file ended
+
+		for (int i = 1; i < dest_num && !error; i++) {
+			ssize_t bytes_teed = tee(ENGINES.pipes[0], ENGINES.pipes[2 * i + 1], bytes_read, 0);
+			if (bytes_teed != bytes_read) {
+				error = (bytes_teed == -1) ? errno : EIO;
+				error_path = dest_display(&dests[i - 1]);
+			}
+		}
+		for (int i = 0; i < dest_num && !error; i++) {
+			int pipe_out = (i == dest_num - 1) ? ENGINES.pipes[0] : ENGINES.pipes[2 * (i + 1)];
+			throttle(&dests[i], bytes_read);
+			uint64_t start_ns = OPTS.stats ? clock_ns() : 0;
+			if (splice_full(pipe_out, dests[i].fd, bytes_read) == -1) {
+				error = errno;
+				error_path = dest_display(&dests[i]);
+			} else {
+				if (OPTS.stats) STATS.dest_write_ns[dests[i].index] += record_latency(OP_WRITE, start_ns);
+				count_written(&dests[i], bytes_read);
+				write_behind(&dests[i], bytes_read);
+			}
+			restore_ioprio();
+		}
+		if (error) break;
+		total_read += bytes_read;
+		count_read(ENGINE_SPLICE, bytes_read, total_read);
+	}
+	if (!error) return 0;
+
+	// Pipes may hold data of the failed chunk
+	close_pipes(ENGINES.pipes, OPTS.dest_num);
+	free(ENGINES.pipes);
+	ENGINES.pipes = NULL;
+	if (total_read == 0 && (error == EINVAL || error == ENOSYS)) { // source or destination can't splice
+		ENGINES.splice_unsupported = true;
+		if (OPTS.verbose) fprintf(stdout, "splice not supported for '%s', using rw engine\n", error_path);
+		bool rewound = lseek(source_fd, start, SEEK_SET) != -1;
+		for (int i = 0; i < dest_num; i++) {
+			if (lseek(dests[i].fd, start, SEEK_SET) == -1) rewound = false;
+		}
+		if (start == -1 && error_path == source_path) rewound = true; // stream refused splice, nothing was consumed
+		if (rewound) return copy_data_rw(source_fd, source_path, dests, dest_num, length, NULL);
+	}
+	fprintf(stderr, "%s: error copying to %s: %s\n", OPTS.name, error_path, strerror(error));
+	STATS.errors++;
+	if (OPTS.fatal_errors) {return -1;} else {return 0;}
+}
+
+#ifdef HAVE_IO_URING
+int uring_setup(struct Uring *uring, size_t chunk_size) {
+	unsigned entries = 1;
+	while (entries < (unsigned)(URING_DEPTH * (OPTS.dest_num + 1))) entries <<= 1; // a full batch of linked chains fits in SQ
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	uring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (uring->fd == -1) return -1;
+	// Nothing mapped yet, so a failure below unmaps only what was
+	uring->sq_ptr = MAP_FAILED;
+	uring->cq_ptr = MAP_FAILED;
+	uring->sqes = MAP_FAILED;
+	for (int i = 0; i < URING_DEPTH; i++) {
+		uring->bufs[i] = MAP_FAILED;
+	}
+	uring->chunk_size = chunk_size;
+
+	uring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	uring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	uring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sq_ptr = mmap(NULL, uring->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	uring->cq_ptr = mmap(NULL, uring->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+	uring->sqes = mmap(NULL, uring->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (uring->sq_ptr == MAP_FAILED || uring->cq_ptr == MAP_FAILED || uring->sqes == MAP_FAILED) {
+		uring_free(uring);
+		return -1;
+	}
+	char *sq = uring->sq_ptr;
+	char *cq = uring->cq_ptr;
+	uring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	uring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	uring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	uring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	uring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	// Registered buffers, one per chunk in flight
+	struct iovec iov[URING_DEPTH];
+	for (int i = 0; i < URING_DEPTH; i++) {
+		uring->bufs[i] = mmap(NULL, chunk_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (uring->bufs[i] == MAP_FAILED) {
+			uring_free(uring);
+			return -1;
+		}
+		iov[i].iov_base = uring->bufs[i];
+		iov[i].iov_len = chunk_size;
+	}
+	if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_BUFFERS, iov, URING_DEPTH) == -1) { // ENOMEM over RLIMIT_MEMLOCK
+		uring_free(uring);
+		return -1;
+	}
+
+	// Fixed file table: slot 0 is the source, slots 1..dest_num are destinations, updated for every file
+	int fds[OPTS.dest_num + 1];
+	for (int i = 0; i <= OPTS.dest_num; i++) {
+		fds[i] = -1;
+	}
+	if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_FILES, fds, OPTS.dest_num + 1) == -1) {
+		uring_free(uring);
+		return -1;
+	}
+	return 0;
+}
+
+void uring_free(struct Uring *uring) { // undoes uring_setup() up to where it got, errno is kept for the caller
+	int saved_errno = errno;
+	for (int i = 0; i < URING_DEPTH; i++) {
+		if (uring->bufs[i] != MAP_FAILED) munmap(uring->bufs[i], uring->chunk_size);
+	}
+	if (uring->sqes != MAP_FAILED) munmap(uring->sqes, uring->sqes_len);
+	if (uring->cq_ptr != MAP_FAILED) munmap(uring->cq_ptr, uring->cq_len);
+	if (uring->sq_ptr != MAP_FAILED) munmap(uring->sq_ptr, uring->sq_len);
+	close(uring->fd);
+	errno = saved_errno;
+}
+
+void uring_release_files(struct Uring *uring, int file_num) { // table keeps closed files referenced until their slots are reset
+	int fds[file_num];
+	for (int i = 0; i < file_num; i++) {
+		fds[i] = -1;
+	}
+	struct io_uring_files_update update;
+	memset(&update, 0, sizeof(update));
+	update.offset = 0;
+	update.fds = (unsigned long)fds;
+	syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_FILES_UPDATE, &update, file_num);
+}
+
+struct io_uring_sqe *uring_get_sqe(struct Uring *uring) {
+	unsigned tail = *uring->sq_tail + uring->sq_queued;
+	unsigned index = tail & uring->sq_mask;
+	struct io_uring_sqe *sqe = &uring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_array[index] = index;
+	uring->sq_queued++;
+	return sqe;
+}
+
+int uring_submit_and_wait(struct Uring *uring) {
+	unsigned to_submit = uring->sq_queued;
+	__atomic_store_n(uring->sq_tail, *uring->sq_tail + to_submit, __ATOMIC_RELEASE);
+	uring->sq_queued = 0;
+	while (1) {
+		int submitted = syscall(__NR_io_uring_enter, uring->fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (submitted >= 0) return 0;
+		if (errno != EINTR) return -1;
+		to_submit = 0; // interrupted while waiting, SQEs were already consumed
+	}
+}
+
+int copy_data_uring(int source_fd, const char *source_path, const struct stat *source_stat, struct DestFile dests[], int dest_num, off_t length) {
+	struct Uring *uring = &ENGINES.uring;
+	if (ENGINES.uring_state == 0) {
+		if (uring_setup(uring, OPTS.bufsize) == 0) {
+			ENGINES.uring_state = 1;
+		} else {
+			ENGINES.uring_state = -1;
+			if (OPTS.verbose) fprintf(stdout, "io_uring unavailable (%s), using rw engine\n", strerror(errno));
+		}
+	}
+	if (ENGINES.uring_state == -1) return copy_data_rw(source_fd, source_path, dests, dest_num, length, NULL);
+
+	struct io_uring_files_update update;
+	int fds[dest_num + 1];
+	fds[0] = source_fd;
+	for (int i = 0; i < dest_num; i++) {
+		fds[i + 1] = dests[i].fd;
+	}
+	memset(&update, 0, sizeof(update));
+	update.offset = 0;
+	update.fds = (unsigned long)fds;
+	if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_FILES_UPDATE, &update, dest_num + 1) == -1) {
+		fprintf(stderr, "%s: cannot register files for '%s': %s\n", OPTS.name, source_path, strerror(errno));
+		return copy_data_rw(source_fd, source_path, dests, dest_num, length, NULL);
+	}
+
+	struct {
+		off_t offset;
+		size_t len;
+		int pending; // completions not yet reaped
+		bool incomplete; // short or failed operation somewhere in the chain
+	} slots[URING_DEPTH];
+	int free_slots[URING_DEPTH];
+	int free_num = URING_DEPTH;
+	for (int i = 0; i < URING_DEPTH; i++) {
+		free_slots[i] = i;
+		slots[i].pending = 0;
+	}
+
+	off_t start = lseek(source_fd, 0, SEEK_CUR); // destinations are at the same offset
+	off_t size = (length < 0) ? source_stat->st_size : start + length;
+	off_t next = start; // offset of next chunk to submit
+	size_t total_done = 0;
+	int error = 0;
+	const char *error_path = NULL;
+	while ((next < size && !error) || free_num < URING_DEPTH) {
+		// Queue one linked chain per free slot: read source, then write to every destination
+		while (free_num > 0 && next < size && !error) {
+			int slot = free_slots[--free_num];
+			size_t len = uring->chunk_size;
+			if ((off_t)len > size - next) len = size - next;
+			slots[slot].offset = next;
+			slots[slot].len = len;
+			slots[slot].pending = dest_num + 1;
+			slots[slot].incomplete = false;
+			for (int i = 0; i < dest_num; i++) { // chain is queued when every destination may take it
+				throttle(&dests[i], len);
+			}
+			restore_ioprio(); // writes carry their destination's priority in the SQE
+			for (int i = 0; i <= dest_num; i++) {
+				struct io_uring_sqe *sqe = uring_get_sqe(uring);
+				sqe->opcode = (i == 0) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+				sqe->fd = i; // index in fixed file table
+				sqe->flags = IOSQE_FIXED_FILE;
+				if (i < dest_num) sqe->flags |= IOSQE_IO_LINK;
+				sqe->addr = (unsigned long)uring->bufs[slot];
+				sqe->len = len;
+				sqe->off = next;
+				sqe->buf_index = slot;
+				sqe->user_data = slot;
+				if (i > 0 && LIMITS.dest_ioprio != NULL) sqe->ioprio = LIMITS.dest_ioprio[dests[i - 1].index];
+			}
+			next += len;
+		}
+		if (uring_submit_and_wait(uring) == -1) {
+			fprintf(stderr, "%s: io_uring_enter failed on '%s': %s\n", OPTS.name, source_path, strerror(errno));
+			uring_release_files(uring, dest_num + 1);
+			STATS.errors++;
+			if (OPTS.fatal_errors) {return -1;} else {return 0;}
+		}
+
+		// Reap completions
+		unsigned head = *uring->cq_head;
+		unsigned tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+			int slot = cqe->user_data;
+			if (cqe->res < 0 || (size_t)cqe->res != slots[slot].len) slots[slot].incomplete = true;
+			if (--slots[slot].pending > 0) continue;
+
+			// Chain finished
+			size_t len = slots[slot].len;
+			if (slots[slot].incomplete) { // redo chunk synchronously, it is idempotent
+				ssize_t bytes_read = pread(source_fd, uring->bufs[slot], len, slots[slot].offset);
+				if (bytes_read != (ssize_t)len) {
+					if (!error) {
+						error = (bytes_read == -1) ? errno : EIO;
+						error_path = source_path;
 					}
-					target[bufsize - 1] = '\0'; // add nul terminator to the end of the string
-					if (remove(path) == -1) {
-						if (errno != ENOENT) { // ignore errors if path does not exist
-							fprintf(stderr, "%s: failed removing symbolic link '%s': %s\n", OPTS.name, path, strerror(errno));
-							free(target);
-							STATS.errors++;
-							if (OPTS.fatal_errors) {return -1;} else {return 0;}
+				} else {
+					for (int i = 0; i < dest_num; i++) {
+						size_t total_written = 0;
+						while (total_written < len) {
+							ssize_t bytes_written = pwrite(dests[i].fd, uring->bufs[slot] + total_written,
+									len - total_written, slots[slot].offset + total_written);
+							if (bytes_written == -1) break;
+							total_written += bytes_written;
+						}
+						count_written(&dests[i], total_written);
+						if (total_written != len && !error) {
+							error = errno;
+							error_path = dest_display(&dests[i]);
 						}
 					}
-					if (symlink(target, path) == -1) {
-						fprintf(stderr, "%s: failed creating symbolic link '%s': %s\n", OPTS.name, path, strerror(errno));
-						free(target);
+				}
+			} else {
+				for (int i = 0; i < dest_num; i++) {
+					count_written(&dests[i], len);
+				}
+			}
+			total_done += len;
+			count_read(ENGINE_URING, len, total_done);
+			free_slots[free_num++] = slot;
+		}
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+		// Chains complete out of order, everything below the oldest one in flight is written
+		if (OPTS.sync == SYNC_STREAM) {
+			off_t written = next;
+			for (int slot = 0; slot < URING_DEPTH; slot++) {
+				if (slots[slot].pending > 0 && slots[slot].offset < written) written = slots[slot].offset;
+			}
+			for (int i = 0; i < dest_num; i++) {
+				flush_windows(dests[i].fd, start, written, &dests[i].flushed);
+			}
+		}
+	}
+	uring_release_files(uring, dest_num + 1); // every chain is reaped
+
+	if (error) {
+		fprintf(stderr, "%s: error copying to %s: %s\n", OPTS.name, error_path, strerror(error));
+		STATS.errors++;
+		if (OPTS.fatal_errors) {return -1;} else {return 0;}
+	}
+
+	// Copy whatever was appended to source after stat
+	if (lseek(source_fd, size, SEEK_SET) == -1) return 0;
+	for (int i = 0; i < dest_num; i++) {
+		if (lseek(dests[i].fd, size, SEEK_SET) == -1) return 0;
+	}
+	if (length >= 0) return 0;
+	return copy_data_rw(source_fd, source_path, dests, dest_num, length, NULL);
+}
+#endif
+
+const char *relative_path(const char *entry_path, int level) {
+	size_t path_len = strlen(entry_path);
+	size_t path_pos = path_len;
+	int count = 0;
+	while (path_pos > 0 && count <= level) {
+		path_pos--;
+		if (entry_path[path_pos] == '/') count++;
+	}
+	if (entry_path[path_pos] == '/') path_pos++; // remove leading slash
+	return &entry_path[path_pos];
+}
+
+dev_t path_device(const char *path) { // device of path, or of its parent directory if path doesn't exist yet
+	struct stat sb;
+	if (stat(path, &sb) == 0) return sb.st_dev;
+	const char *name = relative_path(path, 0);
+	if (name == path) { // no directory part
+		if (stat(".", &sb) == 0) return sb.st_dev;
+		return (dev_t)-1;
+	}
+	size_t dir_len = name - path;
+	char dir[dir_len + 1];
+	memcpy(dir, path, dir_len);
+	dir[dir_len] = '\0';
+	if (stat(dir, &sb) == 0) return sb.st_dev;
+	return (dev_t)-1;
+}
+
+dev_t disk_device(dev_t dev, bool *rotational) { // whole disk holding filesystem dev, or dev itself if it has no block device
+	*rotational = false;
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition", major(dev), minor(dev));
+	bool partition = access(path, F_OK) == 0; // disk is parent of partition in sysfs
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u%s/dev", major(dev), minor(dev), partition ? "/.." : "");
+	FILE *file = fopen(path, "r");
+	if (file == NULL) return dev; // tmpfs, network and other filesystems without a block device
+	unsigned disk_major, disk_minor;
+	int fields = fscanf(file, "%u:%u", &disk_major, &disk_minor);
+	fclose(file);
+	if (fields != 2) return dev;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", disk_major, disk_minor);
+	file = fopen(path, "r");
+	if (file != NULL) {
+		*rotational = fgetc(file) == '1';
+		fclose(file);
+	}
+	return makedev(disk_major, disk_minor);
+}
+
+int count_devices(const struct DestFile dests[], int dest_num) { // distinct device groups of destinations
+	int count = 0;
+	for (int i = 0; i < dest_num; i++) {
+		int j = 0;
+		while (j < i && OPTS.dest_group[dests[j].index] != OPTS.dest_group[dests[i].index]) j++;
+		if (j == i) count++;
+	}
+	return count;
+}
+
+bool share_rotational(const struct DestFile dests[], int dest_num) { // several destinations on one rotational disk
+	for (int i = 0; i < dest_num; i++) {
+		int group = OPTS.dest_group[dests[i].index];
+		if (!OPTS.group_rotational[group]) continue;
+		for (int j = 0; j < i; j++) {
+			if (OPTS.dest_group[dests[j].index] == group) return true;
+		}
+	}
+	return false;
+}
+
+char *dest_path(const char *dest, const char *rel_path) { // allocates memory
+	size_t path_len = snprintf(NULL, 0, "%s/%s", dest, rel_path);
+	char *path = malloc( (path_len + 1) * sizeof(char) );
+	if (path == NULL) return NULL;
+	snprintf(path, path_len + 1, "%s/%s", dest, rel_path);
+	if (path[path_len - 1] == '/') path[path_len - 1] = '\0'; // remove trailing slash
+	return path;
+}
+
+int make_dest_dir(int dirfd, const char *name, mode_t mode, const char *root, const char *rel) {
+	// name is relative to dirfd, root and rel only name it in messages
+	uint64_t start_ns = OPTS.stats ? clock_ns() : 0;
+	int mkdir_result = mkdirat(dirfd, name, mode);
+	if (OPTS.stats) record_latency(OP_MKDIR, start_ns);
+	if (mkdir_result == -1) {
+		if (errno == EEXIST) { // path exists, checking if it's a directory
+			struct stat sb;
+			if (fstatat(dirfd, name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+				fprintf(stderr, "%s: cannot stat '%s': %s\n", OPTS.name, display_path(root, rel), strerror(errno));
+				STATS.errors++;
+				return -1;
+			}
+			if (!S_ISDIR(sb.st_mode)) { // it's not a directory, removing it
+				if (unlinkat(dirfd, name, 0) == 0) { // file at 'path' removed
+					if (mkdirat(dirfd, name, mode) == -1) {
+						fprintf(stderr, "%s: cannot mkdir '%s':%s\n",
+										OPTS.name, display_path(root, rel), strerror(errno));
 						STATS.errors++;
-						if (OPTS.fatal_errors) {return -1;} else {return 0;}
-					} else { // symlink created
-						if (OPTS.stats) STATS.symlinks_created++;
+						return -1;
+					} else { // directory created
+						if (OPTS.stats) STATS.dirs_created++;
 					}
-					free(target);
+				} else { //failed to remove file at 'path'
+					fprintf(stderr, "%s: cannot mkdir, failed overwriting '%s':%s\n",
+									OPTS.name, display_path(root, rel), strerror(errno));
+					STATS.errors++;
+					return -1;
 				}
 			}
+		} else {
+			fprintf(stderr, "%s: failed creating directory '%s': %s\n", OPTS.name, display_path(root, rel), strerror(errno));
+			STATS.errors++;
+			return -1;
+		}
+	} else { // directory created
+		if (OPTS.stats) STATS.dirs_created++;
+	}
+	return 0;
+}
+
+int read_symlink(int dirfd, const char *name, const char *path, char target[PATH_MAX]) {
+	ssize_t target_len = readlinkat(dirfd, name, target, PATH_MAX);
+	if (target_len == -1) {
+		fprintf(stderr, "%s: failed reading symbolic link '%s': %s\n", OPTS.name, path, strerror(errno));
+		STATS.errors++;
+		return -1;
+	}
+	if (target_len == PATH_MAX) target_len--; // truncated
+	target[target_len] = '\0'; // add nul terminator to the end of the string
+	return 0;
+}
+
+int make_dest_symlink(const char *target, int dirfd, const char *name, const char *root, const char *rel) {
+	if (unlinkat(dirfd, name, 0) == -1) {
+		if (errno != ENOENT) { // ignore errors if path does not exist
+			fprintf(stderr, "%s: failed removing symbolic link '%s': %s\n", OPTS.name, display_path(root, rel), strerror(errno));
+			STATS.errors++;
+			return -1;
+		}
+	}
+	if (symlinkat(target, dirfd, name) == -1) {
+		fprintf(stderr, "%s: failed creating symbolic link '%s': %s\n", OPTS.name, display_path(root, rel), strerror(errno));
+		STATS.errors++;
+		return -1;
+	} else { // symlink created
+		if (OPTS.stats) STATS.symlinks_created++;
+	}
+	return 0;
+}
+
+int make_dest_link(const char *target, int dirfd, const char *name, const char *root, const char *rel) {
+	// 1 if target doesn't exist, then nothing is created
+	while (linkat(AT_FDCWD, target, dirfd, name, 0) == -1) {
+		if (errno == ENOENT) return 1;
+		struct stat target_stat, dest_stat;
+		if (errno == EEXIST && stat(target, &target_stat) == 0 && fstatat(dirfd, name, &dest_stat, AT_SYMLINK_NOFOLLOW) == 0) {
+			if (target_stat.st_ino == dest_stat.st_ino && target_stat.st_dev == dest_stat.st_dev) return 0; // linked before
+			if (unlinkat(dirfd, name, 0) == 0) continue;
+		}
+		fprintf(stderr, "%s: failed creating hard link '%s': %s\n", OPTS.name, display_path(root, rel), strerror(errno));
+		STATS.errors++;
+		return -1;
+	}
+	if (OPTS.stats) STATS.hardlinks_created++;
+	return 0;
+}
+
+void raise_fd_limit() { // walk keeps (destinations + 1) directory fds open per level
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+	}
+}
+
+int copy_dir(const char *source_path, const struct stat *source_stat) {
+	raise_fd_limit();
+	int source_fd = open(source_path, O_RDONLY|O_DIRECTORY);
+	if (source_fd == -1) {
+		fprintf(stderr, "%s: cannot read directory '%s'\n", OPTS.name, source_path);
+		return -1;
+	}
+	if (OPTS.stats) STATS.dirs_read++;
+
+	// Root directories of destinations
+	int dest_dirfds[OPTS.dest_num];
+	int opened = 0;
+	for (; opened < OPTS.dest_num; opened++) {
+		if (make_dest_dir(AT_FDCWD, OPTS.dest[opened], source_stat->st_mode, OPTS.dest[opened], NULL) == -1) break;
+		dest_dirfds[opened] = open(OPTS.dest[opened], O_RDONLY|O_DIRECTORY);
+		if (dest_dirfds[opened] == -1) {
+			fprintf(stderr, "%s: cannot open directory '%s': %s\n", OPTS.name, OPTS.dest[opened], strerror(errno));
+			STATS.errors++;
 			break;
-		case(FTW_DNR): // Unreadable directory
-			fprintf(stderr, "%s: cannot read directory '%s'\n", OPTS.name, entry_path);
-			break;
-		case(FTW_F): // File
-			{ // scope to bypass error: switch jumps into scope of identifier with variably modified type
-				// Creating destinations
-				char *dest[OPTS.dest_num];
-				for (int i = 0; i < OPTS.dest_num; i++) {
-					const char *rel_path = relative_path(entry_path, ftwbuf->level - 1); // (level - 1) to change root directory name
-					size_t path_len = snprintf(NULL, 0, "%s/%s", OPTS.dest[i], rel_path);
-					dest[i] = malloc( (path_len + 1) * sizeof(char) );
-					if (snprintf(dest[i], path_len + 1, "%s/%s", OPTS.dest[i], rel_path) != path_len) {
-						fprintf(stderr, "%s: snprintf result not equal %i for '%s'\n", OPTS.name, (int)path_len, dest[i]);
-						STATS.errors++;
-						if (OPTS.fatal_errors) {return -1;} else {return 0;}
-					}
-					if (dest[i][path_len - 1] == '/') dest[i][path_len - 1] = '\0'; // remove trailing slash
-				}
-				STATS.copied_files++;
-				int copy_result = copy_file(entry_path, entry_stat, dest);
-				for (int i = 0; i < OPTS.dest_num; i++) { 
-					free(dest[i]); // free allocated memory
+		}
+	}
+
+	int result = -1;
+	if (opened == OPTS.dest_num) {
+		char path[PATH_MAX]; // source path of current entry, for messages only
+		size_t path_len = strlen(source_path);
+		if (path_len < PATH_MAX) {
+			memcpy(path, source_path, path_len + 1);
+			result = walk_dir(source_fd, dest_dirfds, path, path_len, path_len);
+		}
+	} else {
+		close(source_fd);
+	}
+	for (int i = 0; i < opened; i++) {
+		close(dest_dirfds[i]);
+	}
+	return result;
+}
+
+int walk_dir(int source_dirfd, int dest_dirfds[], char path[PATH_MAX], size_t path_len, size_t root_len) {
+	// Entries are resolved by name against already open directories, path grows in place
+	DIR *dir = fdopendir(source_dirfd); // takes ownership of source_dirfd
+	if (dir == NULL) {
+		fprintf(stderr, "%s: cannot read directory '%s'\n", OPTS.name, path);
+		close(source_dirfd);
+		return 0;
+	}
+	int result = 0;
+	struct dirent *entry;
+	while (result == 0 && (entry = readdir(dir)) != NULL) {
+		const char *name = entry->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+		size_t name_len = strlen(name);
+		if (path_len + 1 + name_len >= PATH_MAX) {
+			path[path_len] = '\0';
+			fprintf(stderr, "%s: path too long in '%s': %s\n", OPTS.name, path, name);
+			STATS.errors++;
+			if (OPTS.fatal_errors) result = -1;
+			continue;
+		}
+		path[path_len] = '/';
+		memcpy(&path[path_len + 1], name, name_len + 1);
+		const char *rel_path = &path[root_len + 1];
+
+		struct stat entry_stat;
+		if (fstatat(dirfd(dir), name, &entry_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+			fprintf(stderr, "%s: cannot call stat on '%s'\n", OPTS.name, path);
+			continue;
+		}
+
+		if (S_ISDIR(entry_stat.st_mode)) { // Directory
+			if (OPTS.stats) STATS.dirs_read++;
+			int child_fds[OPTS.dest_num];
+			int opened = 0;
+			for (; opened < OPTS.dest_num; opened++) {
+				if (make_dest_dir(dest_dirfds[opened], name, entry_stat.st_mode, OPTS.dest[opened], rel_path) == -1) break;
+				child_fds[opened] = openat(dest_dirfds[opened], name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+				if (child_fds[opened] == -1) {
+					fprintf(stderr, "%s: cannot open directory '%s': %s\n",
+									OPTS.name, display_path(OPTS.dest[opened], rel_path), strerror(errno));
+					STATS.errors++;
+					break;
 				}
-				if ( copy_result != 0) {
-					return -1;
+			}
+			if (opened == OPTS.dest_num) {
+				int child_source = openat(dirfd(dir), name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+				if (child_source == -1) {
+					fprintf(stderr, "%s: cannot read directory '%s'\n", OPTS.name, path);
+				} else {
+					result = walk_dir(child_source, child_fds, path, path_len + 1 + name_len, root_len);
 				}
+			} else {
+				if (OPTS.fatal_errors) result = -1;
 			}
-			break;
-		case(FTW_NS): // Stat failed, lack of permission
+			for (int i = 0; i < opened; i++) {
+				close(child_fds[i]);
+			}
+
+		} else if (S_ISLNK(entry_stat.st_mode)) { // Symbolic link
+			if (OPTS.stats) STATS.symlinks_read++;
+			char target[PATH_MAX];
+			int link_result = read_symlink(dirfd(dir), name, path, target);
+			for (int i = 0; link_result == 0 && i < OPTS.dest_num; i++) {
+				link_result = make_dest_symlink(target, dest_dirfds[i], name, OPTS.dest[i], rel_path);
+			}
+			if (link_result == -1 && OPTS.fatal_errors) result = -1;
+
+		} else if (S_ISREG(entry_stat.st_mode)) { // File
+			STATS.copied_files++;
+			result = copy_file(dirfd(dir), name, path, &entry_stat, dest_dirfds, NULL, rel_path);
+
+		} else {
+			fprintf(stderr, "%s: skipping special file '%s'\n", OPTS.name, path);
+		}
+	}
+	path[path_len] = '\0';
+	closedir(dir);
+	return result;
+}
+
+void pool_push(struct Pool *pool, int worker, struct Task *task) {
+	struct Deque *deque = &pool->deques[worker];
+	pool->pending++;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail - deque->head == deque->cap) { // full, grow
+		size_t cap = deque->cap ? deque->cap * 2 : 64;
+		struct Task **tasks = malloc(cap * sizeof(struct Task *));
+		for (size_t i = deque->head; i < deque->tail; i++) {
+			tasks[i % cap] = deque->tasks[i % deque->cap];
+		}
+		free(deque->tasks);
+		deque->tasks = tasks;
+		deque->cap = cap;
+	}
+	deque->tasks[deque->tail++ % deque->cap] = task;
+	pthread_mutex_unlock(&deque->lock);
+
+	// Wake an idle worker to steal it
+	pthread_mutex_lock(&pool->idle_lock);
+	pool->queued++;
+	if (pool->idle > 0) pthread_cond_signal(&pool->idle_cond);
+	pthread_mutex_unlock(&pool->idle_lock);
+}
+
+struct Task *pool_pop(struct Pool *pool, int worker) {
+	// Own deque first, newest task (depth first, keeps directory fds and memory low)
+	struct Deque *deque = &pool->deques[worker];
+	struct Task *task = NULL;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail > deque->head) task = deque->tasks[--deque->tail % deque->cap];
+	pthread_mutex_unlock(&deque->lock);
+	// Steal oldest task of another worker (closest to the root, most work behind it)
+	for (int i = 1; task == NULL && i < pool->workers; i++) {
+		deque = &pool->deques[(worker + i) % pool->workers];
+		pthread_mutex_lock(&deque->lock);
+		if (deque->tail > deque->head) task = deque->tasks[deque->head++ % deque->cap];
+		pthread_mutex_unlock(&deque->lock);
+	}
+	if (task != NULL) {
+		pthread_mutex_lock(&pool->idle_lock);
+		pool->queued--;
+		pthread_mutex_unlock(&pool->idle_lock);
+	}
+	return task;
+}
+
+void pool_task_done(struct Pool *pool, struct Task *task) {
+	free(task->path);
+	free(task);
+	if (--pool->pending == 0) { // last task, wake everyone to exit
+		pthread_mutex_lock(&pool->idle_lock);
+		pthread_cond_broadcast(&pool->idle_cond);
+		pthread_mutex_unlock(&pool->idle_lock);
+	}
+}
+
+struct Task *new_task(enum TaskType type, char *path, const struct stat *stat) {
+	struct Task *task = malloc(sizeof(struct Task));
+	task->type = type;
+	task->path = path;
+	task->stat = *stat;
+	return task;
+}
+
+int pool_dir_task(struct Pool *pool, int worker, struct Task *task) {
+	const char *rel_path = task->path + pool->root_len;
+	if (*rel_path == '/') rel_path++;
+
+	// Creating destination directories before any child task exists
+	if (OPTS.stats) STATS.dirs_read++;
+	for (int i = 0; i < OPTS.dest_num; i++) {
+		char *path = dest_path(OPTS.dest[i], rel_path);
+		int result = make_dest_dir(AT_FDCWD, path, task->stat.st_mode, path, NULL);
+		free(path);
+		if (result == -1) {
+			if (OPTS.fatal_errors) {return -1;} else {return 0;}
+		}
+	}
+
+	DIR *dir = opendir(task->path);
+	if (dir == NULL) {
+		fprintf(stderr, "%s: cannot read directory '%s'\n", OPTS.name, task->path);
+		return 0;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+		char *entry_path = dest_path(task->path, entry->d_name);
+		struct stat entry_stat;
+		if (lstat(entry_path, &entry_stat) == -1) {
 			fprintf(stderr, "%s: cannot call stat on '%s'\n", OPTS.name, entry_path);
-			break;
+			free(entry_path);
+			continue;
+		}
+		if (S_ISDIR(entry_stat.st_mode)) {
+			pool_push(pool, worker, new_task(TASK_DIR, entry_path, &entry_stat));
+		} else if (S_ISREG(entry_stat.st_mode)) {
+			pool_push(pool, worker, new_task(TASK_FILE, entry_path, &entry_stat));
+		} else if (S_ISLNK(entry_stat.st_mode)) { // cheap, done in place
+			if (OPTS.stats) STATS.symlinks_read++;
+			const char *entry_rel = entry_path + pool->root_len + 1;
+			char target[PATH_MAX];
+			int result = read_symlink(AT_FDCWD, entry_path, entry_path, target);
+			for (int i = 0; result == 0 && i < OPTS.dest_num; i++) {
+				char *path = dest_path(OPTS.dest[i], entry_rel);
+				result = make_dest_symlink(target, AT_FDCWD, path, path, NULL);
+				free(path);
+			}
+			free(entry_path);
+			if (result == -1 && OPTS.fatal_errors) {
+				closedir(dir);
+				return -1;
+			}
+		} else {
+			fprintf(stderr, "%s: skipping special file '%s'\n", OPTS.name, entry_path);
+			free(entry_path);
+		}
+	}
+	closedir(dir);
+	return 0;
+}
+
+int pool_file_task(struct Pool *pool, struct Task *task) {
+	const char *rel_path = task->path + pool->root_len + 1;
+	char *dest[OPTS.dest_num];
+	for (int i = 0; i < OPTS.dest_num; i++) {
+		dest[i] = dest_path(OPTS.dest[i], rel_path);
+	}
+	STATS.copied_files++;
+	int copy_result = copy_file(AT_FDCWD, task->path, task->path, &task->stat, NULL, dest, rel_path);
+	for (int i = 0; i < OPTS.dest_num; i++) {
+		free(dest[i]);
+	}
+	return copy_result;
+}
+
+void *pool_worker(void *arg) {
+	struct Worker *self = arg;
+	struct Pool *pool = self->pool;
+	while (!pool->abort) {
+		struct Task *task = pool_pop(pool, self->id);
+		if (task == NULL) { // nothing to steal, sleep until a push or the end
+			pthread_mutex_lock(&pool->idle_lock);
+			pool->idle++;
+			while (pool->queued == 0 && pool->pending > 0 && !pool->abort) {
+				pthread_cond_wait(&pool->idle_cond, &pool->idle_lock);
+			}
+			pool->idle--;
+			bool finished = pool->pending == 0;
+			pthread_mutex_unlock(&pool->idle_lock);
+			if (finished) break;
+			continue;
+		}
+		int result;
+		if (task->type == TASK_DIR) {
+			result = pool_dir_task(pool, self->id, task);
+		} else {
+			result = pool_file_task(pool, task);
+		}
+		if (result != 0) { // fatal error, stop every worker
+			pthread_mutex_lock(&pool->idle_lock);
+			pool->abort = true;
+			pthread_cond_broadcast(&pool->idle_cond);
+			pthread_mutex_unlock(&pool->idle_lock);
+		}
+		pool_task_done(pool, task);
+	}
+	free_engines();
+	return NULL;
+}
+
+int copy_dir_parallel(const char *source_path, const struct stat *source_stat) {
+	struct Pool pool;
+	pool.workers = OPTS.jobs;
+	pool.deques = calloc(pool.workers, sizeof(struct Deque));
+	for (int i = 0; i < pool.workers; i++) {
+		pthread_mutex_init(&pool.deques[i].lock, NULL);
+	}
+	pthread_mutex_init(&pool.idle_lock, NULL);
+	pthread_cond_init(&pool.idle_cond, NULL);
+	pool.pending = 0;
+	pool.queued = 0;
+	pool.idle = 0;
+	pool.abort = false;
+	pool.root_len = strlen(source_path);
+	pool_push(&pool, 0, new_task(TASK_DIR, strdup(source_path), source_stat));
+
+	struct Worker workers[pool.workers];
+	int workers_started = 0;
+	for (int i = 0; i < pool.workers; i++) {
+		workers[i].id = i;
+		workers[i].pool = &pool;
+		int err = pthread_create(&workers[i].thread, NULL, pool_worker, &workers[i]);
+		if (err != 0) {
+			fprintf(stderr, "%s: cannot create worker thread: %s\n", OPTS.name, strerror(err));
+			if (i == 0) exit(EXIT_FAILURE);
+			break; // fewer workers, remaining ones steal the work
+		}
+		workers_started++;
+	}
+	for (int i = 0; i < workers_started; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	// Tasks left after abort
+	for (int i = 0; i < pool.workers; i++) {
+		struct Deque *deque = &pool.deques[i];
+		for (size_t j = deque->head; j < deque->tail; j++) {
+			free(deque->tasks[j % deque->cap]->path);
+			free(deque->tasks[j % deque->cap]);
+		}
+		free(deque->tasks);
+		pthread_mutex_destroy(&deque->lock);
+	}
+	free(pool.deques);
+	return pool.abort ? -1 : 0;
+}
+
+void list_add(struct FileList *list, const char *rel_path, const struct stat *entry_stat) {
+	size_t path_size = strlen(rel_path) + 1;
+	if (list->num == list->cap) {
+		list->cap = list->cap ? list->cap * 2 : 1024;
+		list->entries = realloc(list->entries, list->cap * sizeof(struct Entry));
+	}
+	while (list->paths_len + path_size > list->paths_cap) {
+		list->paths_cap = list->paths_cap ? list->paths_cap * 2 : 64 * 1024;
+		list->paths = realloc(list->paths, list->paths_cap);
 	}
+	if (list->entries == NULL || list->paths == NULL) {
+		fprintf(stderr, "%s: cannot allocate file list: %s\n", OPTS.name, strerror(ENOMEM));
+		exit(EXIT_FAILURE);
+	}
+	struct Entry *entry = &list->entries[list->num++];
+	entry->path = list->paths_len;
+	entry->mode = entry_stat->st_mode;
+	entry->nlink = entry_stat->st_nlink;
+	entry->size = entry_stat->st_size;
+	entry->blocks = entry_stat->st_blocks;
+	entry->blksize = entry_stat->st_blksize;
+	entry->dev = entry_stat->st_dev;
+	entry->ino = entry_stat->st_ino;
+	entry->mtim = entry_stat->st_mtim;
+	entry->physical = 0;
+	memcpy(&list->paths[list->paths_len], rel_path, path_size);
+	list->paths_len += path_size;
+}
+
+void entry_to_stat(const struct Entry *entry, struct stat *entry_stat) {
+	memset(entry_stat, 0, sizeof(struct stat));
+	entry_stat->st_mode = entry->mode;
+	entry_stat->st_nlink = entry->nlink;
+	entry_stat->st_size = entry->size;
+	entry_stat->st_blocks = entry->blocks;
+	entry_stat->st_blksize = entry->blksize;
+	entry_stat->st_dev = entry->dev;
+	entry_stat->st_ino = entry->ino;
+	entry_stat->st_mtim = entry->mtim;
+}
+
+int scan_tree(const char *source_path, struct FileList *list) {
+	memset(list, 0, sizeof(struct FileList));
+	list->source_path = source_path;
+	raise_fd_limit();
+	int source_fd = open(source_path, O_RDONLY|O_DIRECTORY);
+	if (source_fd == -1) {
+		fprintf(stderr, "%s: cannot read directory '%s'\n", OPTS.name, source_path);
+		return -1;
+	}
+	if (OPTS.stats) STATS.dirs_read++;
+	char path[PATH_MAX]; // source path of current entry
+	size_t path_len = strlen(source_path);
+	if (path_len >= PATH_MAX) {
+		close(source_fd);
+		return -1;
+	}
+	memcpy(path, source_path, path_len + 1);
+	int result = scan_dir(source_fd, list, path, path_len, path_len);
+	if (OPTS.global_progress) {
+		char *str_size = human_readable(STATS.total_size);
+		fprintf(stdout, "Counting files: %i, total size: %s\n", STATS.total_files, str_size);
+		free(str_size);
+	}
+	return result;
+}
+
+int scan_dir(int source_dirfd, struct FileList *list, char path[PATH_MAX], size_t path_len, size_t root_len) {
+	// Same traversal as walk_dir(), entries are recorded instead of copied
+	DIR *dir = fdopendir(source_dirfd); // takes ownership of source_dirfd
+	if (dir == NULL) {
+		fprintf(stderr, "%s: cannot read directory '%s'\n", OPTS.name, path);
+		close(source_dirfd);
+		return 0;
+	}
+	int result = 0;
+	struct dirent *entry;
+	while (result == 0 && (entry = readdir(dir)) != NULL) {
+		const char *name = entry->d_name;
+		if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+		size_t name_len = strlen(name);
+		if (path_len + 1 + name_len >= PATH_MAX) {
+			path[path_len] = '\0';
+			fprintf(stderr, "%s: path too long in '%s': %s\n", OPTS.name, path, name);
+			STATS.errors++;
+			if (OPTS.fatal_errors) result = -1;
+			continue;
+		}
+		path[path_len] = '/';
+		memcpy(&path[path_len + 1], name, name_len + 1);
+		const char *rel_path = &path[root_len + 1];
+
+		struct stat entry_stat;
+		if (fstatat(dirfd(dir), name, &entry_stat, AT_SYMLINK_NOFOLLOW) == -1) {
+			fprintf(stderr, "%s: cannot call stat on '%s'\n", OPTS.name, path);
+			continue;
+		}
+
+		if (S_ISDIR(entry_stat.st_mode)) { // Directory
+			if (OPTS.stats) STATS.dirs_read++;
+			list_add(list, rel_path, &entry_stat);
+			int child_source = openat(dirfd(dir), name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+			if (child_source == -1) {
+				fprintf(stderr, "%s: cannot read directory '%s'\n", OPTS.name, path);
+			} else {
+				result = scan_dir(child_source, list, path, path_len + 1 + name_len, root_len);
+			}
+		} else if (S_ISLNK(entry_stat.st_mode)) { // Symbolic link
+			if (OPTS.stats) STATS.symlinks_read++;
+			list_add(list, rel_path, &entry_stat);
+		} else if (S_ISREG(entry_stat.st_mode)) { // File
+			list_add(list, rel_path, &entry_stat);
+			if (OPTS.order == ORDER_EXTENT) list->entries[list->num - 1].physical = first_extent(dirfd(dir), name);
+			STATS.total_files++;
+			STATS.total_size += entry_stat.st_size;
+			if (OPTS.global_progress && STATS.total_files % 1024 == 0) { // a line per file costs more than the scan
+				char *str_size = human_readable(STATS.total_size);
+				fprintf(stdout, "Counting files: %i, total size: %s\r", STATS.total_files, str_size);
+				fflush(stdout);
+				free(str_size);
+			}
+		} else {
+			fprintf(stderr, "%s: skipping special file '%s'\n", OPTS.name, path);
+		}
+	}
+	path[path_len] = '\0';
+	closedir(dir);
+	return result;
+}
+
+uint64_t first_extent(int dirfd, const char *name) { // --order=extent, 0 for empty, inline or unmapped data
+	int fd = openat(dirfd, name, O_RDONLY|O_NOFOLLOW|O_NOCTTY);
+	if (fd == -1) return 0;
+	union { // room for one extent after the header
+		struct fiemap map;
+		char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} fiemap;
+	memset(&fiemap, 0, sizeof(fiemap));
+	fiemap.map.fm_length = FIEMAP_MAX_OFFSET;
+	fiemap.map.fm_extent_count = 1;
+	uint64_t physical = 0;
+	if (ioctl(fd, FS_IOC_FIEMAP, &fiemap.map) == 0 && fiemap.map.fm_mapped_extents == 1 &&
+			!(fiemap.map.fm_extents[0].fe_flags & FIEMAP_EXTENT_UNKNOWN)) {
+		physical = fiemap.map.fm_extents[0].fe_physical;
+	}
+	close(fd);
+	return physical;
+}
+
+int compare_entries(const void *a, const void *b) { // --order, regular files last, then by device, first extent and inode
+	const struct Entry *x = a;
+	const struct Entry *y = b;
+	if (S_ISREG(x->mode) != S_ISREG(y->mode)) return S_ISREG(x->mode) ? 1 : -1;
+	if (x->dev != y->dev) return x->dev < y->dev ? -1 : 1;
+	if (x->physical != y->physical) return x->physical < y->physical ? -1 : 1;
+	if (x->ino != y->ino) return x->ino < y->ino ? -1 : 1;
 	return 0;
 }
+
+int copy_list_entry(struct FileList *list, const struct Entry *entry) {
+	// Directories, symlinks and files by path, parent directories already exist in destinations
+	const char *rel_path = &list->paths[entry->path];
+	char path[PATH_MAX];
+	if (snprintf(path, PATH_MAX, "%s/%s", list->source_path, rel_path) >= PATH_MAX) {
+		fprintf(stderr, "%s: path too long in '%s': %s\n", OPTS.name, list->source_path, rel_path);
+		STATS.errors++;
+		if (OPTS.fatal_errors) {return -1;} else {return 0;}
+	}
+	char *dest[OPTS.dest_num];
+	for (int i = 0; i < OPTS.dest_num; i++) {
+		dest[i] = dest_path(OPTS.dest[i], rel_path);
+	}
+	int result = 0;
+	if (S_ISDIR(entry->mode)) {
+		for (int i = 0; result == 0 && i < OPTS.dest_num; i++) {
+			result = make_dest_dir(AT_FDCWD, dest[i], entry->mode, dest[i], NULL);
+		}
+		if (!OPTS.fatal_errors) result = 0;
+	} else if (S_ISLNK(entry->mode)) {
+		char target[PATH_MAX];
+		result = read_symlink(AT_FDCWD, path, path, target);
+		for (int i = 0; result == 0 && i < OPTS.dest_num; i++) {
+			result = make_dest_symlink(target, AT_FDCWD, dest[i], dest[i], NULL);
+		}
+		if (!OPTS.fatal_errors) result = 0;
+	} else {
+		struct stat entry_stat;
+		entry_to_stat(entry, &entry_stat);
+		STATS.copied_files++;
+		result = copy_file(AT_FDCWD, path, path, &entry_stat, NULL, dest, rel_path);
+	}
+	for (int i = 0; i < OPTS.dest_num; i++) {
+		free(dest[i]);
+	}
+	return result;
+}
+
+void *list_worker(void *arg) {
+	struct FileList *list = arg;
+	while (!list->abort) {
+		size_t next = list->next++;
+		if (next >= list->num) break;
+		if (!S_ISREG(list->entries[next].mode)) continue;
+		if (copy_list_entry(list, &list->entries[next]) != 0) list->abort = true;
+	}
+	free_engines();
+	return NULL;
+}
+
+int copy_list(const struct stat *source_stat, struct FileList *list) {
+	for (int i = 0; i < OPTS.dest_num; i++) {
+		if (make_dest_dir(AT_FDCWD, OPTS.dest[i], source_stat->st_mode, OPTS.dest[i], NULL) == -1) return -1;
+	}
+	// Directories and symlinks first, then files are independent of each other
+	for (size_t i = 0; i < list->num; i++) {
+		if (S_ISREG(list->entries[i].mode)) continue;
+		if (copy_list_entry(list, &list->entries[i]) != 0) return -1;
+	}
+	// Parents exist in destinations now, reordering entries can't put a file before its directory
+	if (OPTS.order != ORDER_NONE) qsort(list->entries, list->num, sizeof(struct Entry), compare_entries);
+	list->next = 0;
+	list->abort = false;
+	if (OPTS.jobs == 1) {
+		list_worker(list);
+		return list->abort ? -1 : 0;
+	}
+	pthread_t workers[OPTS.jobs];
+	int workers_started = 0;
+	for (int i = 0; i < OPTS.jobs; i++) {
+		int err = pthread_create(&workers[i], NULL, list_worker, list);
+		if (err != 0) {
+			fprintf(stderr, "%s: cannot create worker thread: %s\n", OPTS.name, strerror(err));
+			break; // fewer workers, remaining ones take the files
+		}
+		workers_started++;
+	}
+	if (workers_started == 0) list_worker(list);
+	for (int i = 0; i < workers_started; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	return list->abort ? -1 : 0;
+}
+
+void free_list(struct FileList *list) {
+	free(list->entries);
+	free(list->paths);
+}
+
+char **read_sources(const char *files_from, char delim, char *sources[], size_t *source_num) {
+	// Sources from arguments followed by the ones listed in files_from, '-' is stdin, empty names are skipped
+	FILE *file = strcmp(files_from, "-") == 0 ? stdin : fopen(files_from, "r");
+	if (file == NULL) {
+		fprintf(stderr, "%s: cannot open source list '%s': %s\n", OPTS.name, files_from, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	size_t cap = *source_num + 1024;
+	char **list = malloc(cap * sizeof(char *));
+	if (list == NULL) {
+		fprintf(stderr, "%s: cannot allocate source list: %s\n", OPTS.name, strerror(ENOMEM));
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < *source_num; i++) {
+		list[i] = sources[i];
+	}
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t len;
+	while ((len = getdelim(&line, &line_cap, delim, file)) != -1) {
+		if (line[len - 1] == delim) line[--len] = '\0';
+		if (len == 0) continue;
+		if (*source_num == cap) {
+			cap *= 2;
+			list = realloc(list, cap * sizeof(char *));
+			if (list == NULL) {
+				fprintf(stderr, "%s: cannot allocate source list: %s\n", OPTS.name, strerror(ENOMEM));
+				exit(EXIT_FAILURE);
+			}
+		}
+		list[(*source_num)++] = strdup(line);
+	}
+	if (ferror(file)) {
+		fprintf(stderr, "%s: error reading source list '%s': %s\n", OPTS.name, files_from, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	free(line);
+	if (file != stdin) fclose(file);
+	return list;
+}
+
+void *batch_worker(void *arg) {
+	struct Batch *batch = arg;
+	// Parent directory of the previous source, kept open while the following sources are in it too
+	char *source_dir = NULL;
+	int source_dirfd = AT_FDCWD;
+	while (!batch->abort) {
+		size_t next = batch->next++;
+		if (next >= batch->num) break;
+		if (!S_ISREG(batch->stats[next].st_mode)) continue;
+		const char *source_path = batch->sources[next];
+		const char *name = relative_path(source_path, 0);
+		size_t dir_len = name - source_path; // with trailing slash, 0 - in working directory
+		if (source_dir == NULL || strlen(source_dir) != dir_len || strncmp(source_dir, source_path, dir_len) != 0) {
+			if (source_dirfd != AT_FDCWD) close(source_dirfd);
+			free(source_dir);
+			source_dir = strndup(source_path, dir_len);
+			source_dirfd = (dir_len == 0) ? AT_FDCWD : open(source_dir, O_RDONLY|O_DIRECTORY);
+			if (source_dirfd == -1) {
+				fprintf(stderr, "%s: cannot read '%s': %s\n", OPTS.name, source_path, strerror(errno));
+				free(source_dir);
+				source_dir = NULL;
+				source_dirfd = AT_FDCWD;
+				STATS.errors++;
+				STATS.copied_files++;
+				if (OPTS.fatal_errors) batch->abort = true;
+				continue;
+			}
+		}
+		if (copy_file(source_dirfd, name, source_path, &batch->stats[next], batch->target_fds, NULL, NULL) != 0) batch->abort = true;
+		STATS.copied_files++;
+	}
+	if (source_dirfd != AT_FDCWD) close(source_dirfd);
+	free(source_dir);
+	free_engines();
+	return NULL;
+}
+
+int compare_batch_names(const void *a, const void *b) { // by name, then in order of arguments
+	const struct BatchName *x = a;
+	const struct BatchName *y = b;
+	int cmp = strcmp(x->name, y->name);
+	if (cmp != 0) return cmp;
+	return x->index < y->index ? -1 : (x->index > y->index);
+}
+
+int copy_batch(char *sources[], size_t source_num) {
+	// Every source is copied into every target directory in OPTS.dest. Regular files go first, in parallel with -j,
+	// then directories one by one, OPTS.dest pointing to their roots meanwhile.
+	char *targets[OPTS.dest_num];
+	memcpy(targets, OPTS.dest, sizeof(targets));
+	struct Batch batch = {
+		.sources = sources,
+		.stats = malloc(source_num * sizeof(struct stat)),
+		.num = source_num,
+		.targets = targets,
+		.target_fds = NULL,
+		.next = 0,
+		.abort = false,
+	};
+	if (batch.stats == NULL) {
+		fprintf(stderr, "%s: cannot allocate source list: %s\n", OPTS.name, strerror(ENOMEM));
+		exit(EXIT_FAILURE);
+	}
+	bool failed = false;
+
+	// Stat sources and check destinations before anything is copied
+	int overwriting = 0;
+	for (size_t i = 0; i < source_num; i++) {
+		size_t source_len = strlen(sources[i]);
+		if (source_len > 1 && sources[i][source_len - 1] == '/') sources[i][source_len - 1] = '\0'; // remove trailing slash
+		struct stat *source_stat = &batch.stats[i];
+		if (lstat(sources[i], source_stat) == -1) {
+			fprintf(stderr, "%s: cannot stat '%s': %s\n", OPTS.name, sources[i], strerror(errno));
+			source_stat->st_mode = 0;
+		} else if (!S_ISREG(source_stat->st_mode) && !S_ISDIR(source_stat->st_mode)) {
+			fprintf(stderr, "%s: '%s' is not a regular file or directory\n", OPTS.name, sources[i]);
+			source_stat->st_mode = 0;
+		}
+		if (source_stat->st_mode == 0) { // skipped
+			STATS.errors++;
+			failed = true;
+			if (OPTS.fatal_errors) exit(EXIT_FAILURE);
+			continue;
+		}
+		const char *name = relative_path(sources[i], 0);
+		for (int j = 0; j < OPTS.dest_num; j++) {
+			char *path = dest_path(targets[j], name);
+			if (strcmp(path, sources[i]) == 0) { // DEST is the same as SOURCE
+				fprintf(stderr, "%s: source and destination cannot be the same: '%s'\n", OPTS.name, path);
+				exit(EXIT_FAILURE);
+			}
+			struct stat buff;
+			if (!OPTS.force && !OPTS.update && !OPTS.delta && stat(path, &buff) == 0) {
+				fprintf(stderr, "%s: destination already exists '%s'\n", OPTS.name, path);
+				overwriting = 1;
+			}
+			free(path);
+		}
+		if (S_ISREG(source_stat->st_mode)) {
+			STATS.total_files++;
+			STATS.total_size += source_stat->st_size;
+		}
+	}
+	if (overwriting == 1) {
+		fprintf(stdout, "%s: aborting copy, use '-f' to overwrite existing files\n", OPTS.name);
+		exit(EXIT_FAILURE);
+	}
+
+	// Sources of the same name would be copied to one destination, by two workers at once with -j,
+	// like cp the first one is copied and the later ones are skipped
+	struct BatchName *names = malloc(source_num * sizeof(struct BatchName));
+	if (names == NULL) {
+		fprintf(stderr, "%s: cannot allocate source list: %s\n", OPTS.name, strerror(ENOMEM));
+		exit(EXIT_FAILURE);
+	}
+	size_t name_num = 0;
+	for (size_t i = 0; i < source_num; i++) {
+		if (batch.stats[i].st_mode == 0) continue;
+		names[name_num].name = relative_path(sources[i], 0);
+		names[name_num].index = i;
+		name_num++;
+	}
+	qsort(names, name_num, sizeof(struct BatchName), compare_batch_names);
+	for (size_t i = 1; i < name_num; i++) {
+		size_t first = i - 1;
+		while (i < name_num && strcmp(names[i].name, names[first].name) == 0) {
+			struct stat *source_stat = &batch.stats[names[i].index];
+			fprintf(stderr, "%s: skipping '%s', '%s' has the same name in target directories\n", OPTS.name,
+					sources[names[i].index], sources[names[first].index]);
+			if (S_ISREG(source_stat->st_mode)) {
+				STATS.total_files--;
+				STATS.total_size -= source_stat->st_size;
+			}
+			source_stat->st_mode = 0; // skipped
+			STATS.errors++;
+			failed = true;
+			if (OPTS.fatal_errors) exit(EXIT_FAILURE);
+			i++;
+		}
+	}
+	free(names);
+
+	int target_fds[OPTS.dest_num];
+	for (int j = 0; j < OPTS.dest_num; j++) {
+		target_fds[j] = open(targets[j], O_RDONLY|O_DIRECTORY);
+		if (target_fds[j] == -1) {
+			fprintf(stderr, "%s: cannot open directory '%s': %s\n", OPTS.name, targets[j], strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	batch.target_fds = target_fds;
+
+	// Counting or ordering files of directories, each tree is walked once and copied from its list
+	struct FileList *lists = NULL;
+	if (OPTS.global_progress || OPTS.order != ORDER_NONE) {
+		lists = calloc(source_num, sizeof(struct FileList));
+		for (size_t i = 0; i < source_num; i++) {
+			if (!S_ISDIR(batch.stats[i].st_mode)) continue;
+			if (scan_tree(sources[i], &lists[i]) != 0) {
+				STATS.errors++;
+				failed = true;
+				if (OPTS.fatal_errors) exit(EXIT_FAILURE);
+				batch.stats[i].st_mode = 0;
+			}
+		}
+	}
+	STATS.str_total_size = human_readable(STATS.total_size); // malloc
+	start_progress();
+
+	// Copying regular files
+	if (OPTS.jobs == 1) {
+		batch_worker(&batch);
+	} else {
+		pthread_t workers[OPTS.jobs];
+		int workers_started = 0;
+		for (int i = 0; i < OPTS.jobs; i++) {
+			int err = pthread_create(&workers[i], NULL, batch_worker, &batch);
+			if (err != 0) {
+				fprintf(stderr, "%s: cannot create worker thread: %s\n", OPTS.name, strerror(err));
+				break; // fewer workers, remaining ones take the files
+			}
+			workers_started++;
+		}
+		if (workers_started == 0) batch_worker(&batch);
+		for (int i = 0; i < workers_started; i++) {
+			pthread_join(workers[i], NULL);
+		}
+	}
+	if (batch.abort) failed = true;
+
+	// Copying directories
+	for (size_t i = 0; i < source_num && !batch.abort; i++) {
+		if (!S_ISDIR(batch.stats[i].st_mode)) continue;
+		const char *name = relative_path(sources[i], 0);
+		for (int j = 0; j < OPTS.dest_num; j++) {
+			OPTS.dest[j] = dest_path(targets[j], name);
+		}
+		OPTS.checksum_root = name;
+		int copy_result;
+		if (lists != NULL) {
+			copy_result = copy_list(&batch.stats[i], &lists[i]);
+		} else if (OPTS.jobs > 1) {
+			copy_result = copy_dir_parallel(sources[i], &batch.stats[i]);
+		} else {
+			copy_result = copy_dir(sources[i], &batch.stats[i]);
+		}
+		for (int j = 0; j < OPTS.dest_num; j++) {
+			free(OPTS.dest[j]);
+			OPTS.dest[j] = targets[j];
+		}
+		OPTS.checksum_root = NULL;
+		free_hardlinks(); // first links are recorded relative to roots of this source
+		if (copy_result != 0) {
+			failed = true;
+			if (OPTS.fatal_errors) batch.abort = true;
+		}
+	}
+
+	for (size_t i = 0; lists != NULL && i < source_num; i++) {
+		free_list(&lists[i]);
+	}
+	free(lists);
+	free(batch.stats);
+	for (int j = 0; j < OPTS.dest_num; j++) {
+		close(target_fds[j]);
+	}
+	return failed ? -1 : 0;
+}